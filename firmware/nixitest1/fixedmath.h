@@ -0,0 +1,135 @@
+//
+// Fixed point math for the CH32V003.
+//
+// The CH32V003 is an RV32EC core, so there is no multiply or divide
+// instruction, and GCC's __mulsi3 and __divsi3 are slow.  These are the
+// shift-and-add versions of what we need, in the same spirit as
+// FastMultiply in nixitest1.c (which is still what the ADC ISR uses, since
+// there we already know which operand is small).
+//
+// Cycle counts are estimates for code running from RAM, counting one cycle
+// per instruction and one more per taken branch.  From flash, add about 20%.
+// To measure them on the chip, build with ENABLE_FIXMATH_BENCH and use query
+// 13 (see FixMathBench in nixitest1.c).
+//
+// fixedmath/ has the host tests, `make -C fixedmath test`.
+//
+
+#ifndef _FIXEDMATH_H
+#define _FIXEDMATH_H
+
+#include <stdint.h>
+
+// a * b, for any a and b.  Loops over the bits of the smaller one, so it
+// exits as soon as that runs out of set bits.
+//   ~6 cycles + 6 per bit of the smaller operand (~100 for 16 bits).
+static inline uint32_t FixMul( uint32_t a, uint32_t b )
+{
+	if( a < b )
+	{
+		uint32_t t = a;
+		a = b;
+		b = t;
+	}
+	uint32_t ret = 0;
+	while( b )
+	{
+		if( b & 1 )
+			ret += a;
+		a <<= 1;
+		b >>= 1;
+	}
+	return ret;
+}
+
+// Signed a * b.
+//   FixMul + ~8 cycles.
+static inline int32_t FixMulS( int32_t a, int32_t b )
+{
+	uint32_t ret = FixMul( ( a < 0 ) ? -a : a, ( b < 0 ) ? -b : b );
+	return ( ( a ^ b ) < 0 ) ? -ret : ret;
+}
+
+// ( a * b ) >> q, without needing the 64-bit product.  The low q bits of b
+// are done like long multiplication, shifting the sum right as we go, which
+// gives exactly the floor of the full product; the rest is a plain FixMul.
+// Magnitudes round toward zero, and the result has to fit in 32 bits.
+//   ~8 cycles per fractional bit, + FixMul of the integer part of b.
+//   (Q8 with a 16.8 b: ~70 + ~60 = ~130)
+static inline int32_t FixMulQ( int32_t a, int32_t b, int q )
+{
+	uint32_t ua = ( a < 0 ) ? -a : a;
+	uint32_t ub = ( b < 0 ) ? -b : b;
+	uint32_t ret = 0;
+	int i;
+	for( i = 0; i < q; i++ )
+	{
+		ret = ( ret + ( ( ub & 1 ) ? ua : 0 ) ) >> 1;
+		ub >>= 1;
+	}
+	ret += FixMul( ua, ub );
+	return ( ( a ^ b ) < 0 ) ? -ret : ret;
+}
+
+// Saturating a + b and a - b.
+//   ~6 cycles, ~9 when it saturates.
+static inline int32_t FixSatAdd( int32_t a, int32_t b )
+{
+	int32_t r = (uint32_t)a + (uint32_t)b;
+	// Overflowed if a and b have the same sign and r doesn't.
+	if( ( ( a ^ r ) & ( b ^ r ) ) < 0 )
+		r = ( a < 0 ) ? INT32_MIN : INT32_MAX;
+	return r;
+}
+
+static inline int32_t FixSatSub( int32_t a, int32_t b )
+{
+	int32_t r = (uint32_t)a - (uint32_t)b;
+	// Overflowed if a and b have different signs and r's differs from a's.
+	if( ( ( a ^ b ) & ( a ^ r ) ) < 0 )
+		r = ( a < 0 ) ? INT32_MIN : INT32_MAX;
+	return r;
+}
+
+// x / d for a constant d (1..32767) and 0 <= x < 32768, as a multiply by a
+// precomputed reciprocal and a shift.  With shift = 16 + floor(log2(d)), and
+// the reciprocal rounded up, this is exact over the whole range of x, and
+// x times the reciprocal (at most 2^16+1) still fits in 32 bits.  All of the
+// FIX_RECIP math folds at compile time.
+//   FixMul of x (~6 per bit of x, ~100 for 15 bits), vs ~300+ for __udivsi3.
+#define FIX_LOG2( d ) ( \
+	( (d) >= 1<<14 ) ? 14 : ( (d) >= 1<<13 ) ? 13 : ( (d) >= 1<<12 ) ? 12 : \
+	( (d) >= 1<<11 ) ? 11 : ( (d) >= 1<<10 ) ? 10 : ( (d) >= 1<<9 ) ? 9 : \
+	( (d) >= 1<<8 ) ? 8 : ( (d) >= 1<<7 ) ? 7 : ( (d) >= 1<<6 ) ? 6 : \
+	( (d) >= 1<<5 ) ? 5 : ( (d) >= 1<<4 ) ? 4 : ( (d) >= 1<<3 ) ? 3 : \
+	( (d) >= 1<<2 ) ? 2 : ( (d) >= 1<<1 ) ? 1 : 0 )
+#define FIX_RECIP_SHIFT( d ) ( 16 + FIX_LOG2( d ) )
+#define FIX_RECIP( d ) ( ( ( 1u << FIX_RECIP_SHIFT( d ) ) + (d) - 1 ) / (d) )
+#define FixDivConst( x, d ) \
+	( FixMul( (x), FIX_RECIP( d ) ) >> FIX_RECIP_SHIFT( d ) )
+
+// floor( sqrt( x ) ), one result bit at a time.
+//   ~10 cycles per result bit, 16 bits, so ~170 worst case.
+static inline uint32_t FixSqrt( uint32_t x )
+{
+	uint32_t ret = 0;
+	uint32_t bit = 1u<<30;
+	while( bit > x )
+		bit >>= 2;
+	while( bit )
+	{
+		if( x >= ret + bit )
+		{
+			x -= ret + bit;
+			ret = ( ret >> 1 ) + bit;
+		}
+		else
+		{
+			ret >>= 1;
+		}
+		bit >>= 2;
+	}
+	return ret;
+}
+
+#endif
@@ -0,0 +1,187 @@
+// Host tests for ../fixedmath.h, against 64-bit reference math.
+//
+//   FixDivConst  every d in 1..32767, every x in 0..32767.
+//   FixSqrt      every x below 2^24, and r*r - 1, r*r, r*r + r, r*r + 2r for
+//                every r up to 65535, which covers every place the result
+//                changes over the full 32-bit range.
+//   FixMulQ      every a, b in -2048..2047 for q = 8, then random a, b and q
+//                (0..16) wherever the result fits in 32 bits.
+//   FixMul(S)    every a, b in 0..4095, then random.
+//   FixSatAdd/Sub every pair from a set of edge values, then random.
+//
+// Build and run with `make test`.  Exits non-zero on the first failure.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "../fixedmath.h"
+
+uint64_t checks;
+
+static uint64_t Rand64()
+{
+	// xorshift64*, so runs are repeatable.
+	static uint64_t s = 0x9e3779b97f4a7c15ull;
+	s ^= s >> 12;
+	s ^= s << 25;
+	s ^= s >> 27;
+	return s * 0x2545f4914f6cdd1dull;
+}
+
+#define FAIL( ... ) { fprintf( stderr, "FAIL: " __VA_ARGS__ ); exit( 1 ); }
+
+static void TestDivConst()
+{
+	uint32_t d, x;
+	for( d = 1; d < 32768; d++ )
+	{
+		uint32_t recip = FIX_RECIP( d );
+		int shift = FIX_RECIP_SHIFT( d );
+		for( x = 0; x < 32768; x++ )
+		{
+			uint32_t got = FixMul( x, recip ) >> shift;
+			if( got != x / d )
+				FAIL( "FixDivConst( %u, %u ) = %u, not %u\n", x, d, got, x / d );
+		}
+		checks += 32768;
+	}
+	// And as the macro, the way the firmware uses it.
+	for( x = 0; x < 32768; x++ )
+		if( FixDivConst( x, 6 ) != x / 6 || FixDivConst( x, 120 ) != x / 120 )
+			FAIL( "FixDivConst macro at %u\n", x );
+	printf( "FixDivConst: ok\n" );
+}
+
+static void CheckSqrt( uint32_t x )
+{
+	uint64_t r = FixSqrt( x );
+	if( r * r > x || ( r + 1 ) * ( r + 1 ) <= x )
+		FAIL( "FixSqrt( %u ) = %llu\n", x, (unsigned long long)r );
+	checks++;
+}
+
+static void TestSqrt()
+{
+	uint32_t x, r;
+	for( x = 0; x < ( 1u << 24 ); x++ )
+		CheckSqrt( x );
+	for( r = 1; r < 65536; r++ )
+	{
+		uint32_t sq = r * r;
+		CheckSqrt( sq - 1 );
+		CheckSqrt( sq );
+		CheckSqrt( sq + r );
+		CheckSqrt( sq + 2 * r );
+	}
+	CheckSqrt( 0xffffffff );
+	printf( "FixSqrt: ok\n" );
+}
+
+static int64_t RefMulQ( int32_t a, int32_t b, int q )
+{
+	// Magnitudes round toward zero.
+	uint64_t m = (uint64_t)llabs( a ) * (uint64_t)llabs( b );
+	int64_t r = m >> q;
+	return ( ( a < 0 ) != ( b < 0 ) ) ? -r : r;
+}
+
+static void CheckMulQ( int32_t a, int32_t b, int q )
+{
+	int32_t got = FixMulQ( a, b, q );
+	if( got != RefMulQ( a, b, q ) )
+		FAIL( "FixMulQ( %d, %d, %d ) = %d, not %lld\n", a, b, q, got,
+			(long long)RefMulQ( a, b, q ) );
+	checks++;
+}
+
+static void TestMulQ()
+{
+	int32_t a, b;
+	int i;
+	for( a = -2048; a < 2048; a++ )
+		for( b = -2048; b < 2048; b++ )
+			CheckMulQ( a, b, 8 );
+	for( i = 0; i < 10000000; i++ )
+	{
+		uint64_t r = Rand64();
+		int q = r % 17;
+		a = (int32_t)( r >> 8 ) >> ( ( r >> 40 ) & 31 );
+		b = (int32_t)( r >> 32 ) >> ( ( r >> 45 ) & 31 );
+		// Only where the result fits, and not INT32_MIN, which has no
+		// magnitude in 32 bits.
+		if( a == INT32_MIN || b == INT32_MIN ) continue;
+		if( llabs( RefMulQ( a, b, q ) ) > INT32_MAX ) continue;
+		CheckMulQ( a, b, q );
+	}
+	printf( "FixMulQ: ok\n" );
+}
+
+static void TestMul()
+{
+	uint32_t a, b;
+	int i;
+	for( a = 0; a < 4096; a++ )
+		for( b = 0; b < 4096; b++ )
+		{
+			if( FixMul( a, b ) != a * b )
+				FAIL( "FixMul( %u, %u )\n", a, b );
+			if( FixMulS( -(int32_t)a, b ) != -(int32_t)( a * b ) )
+				FAIL( "FixMulS( -%u, %u )\n", a, b );
+		}
+	checks += 4096 * 4096 * 2;
+	for( i = 0; i < 10000000; i++ )
+	{
+		uint64_t r = Rand64();
+		int32_t sa = (int32_t)r >> ( ( r >> 32 ) & 31 );
+		int32_t sb = (int32_t)( r >> 24 ) >> ( ( r >> 40 ) & 31 );
+		// Wraps modulo 2^32, the same as a plain multiply.
+		if( (uint32_t)FixMulS( sa, sb ) != (uint32_t)sa * (uint32_t)sb && sa != INT32_MIN && sb != INT32_MIN )
+			FAIL( "FixMulS( %d, %d )\n", sa, sb );
+		if( FixMul( (uint32_t)sa, (uint32_t)sb ) != (uint32_t)sa * (uint32_t)sb )
+			FAIL( "FixMul( %u, %u )\n", (uint32_t)sa, (uint32_t)sb );
+		checks += 2;
+	}
+	printf( "FixMul, FixMulS: ok\n" );
+}
+
+static int32_t Sat( int64_t v )
+{
+	return ( v > INT32_MAX ) ? INT32_MAX : ( v < INT32_MIN ) ? INT32_MIN : v;
+}
+
+static void CheckSat( int32_t a, int32_t b )
+{
+	if( FixSatAdd( a, b ) != Sat( (int64_t)a + b ) )
+		FAIL( "FixSatAdd( %d, %d )\n", a, b );
+	if( FixSatSub( a, b ) != Sat( (int64_t)a - b ) )
+		FAIL( "FixSatSub( %d, %d )\n", a, b );
+	checks += 2;
+}
+
+static void TestSat()
+{
+	static const int32_t edges[] = { INT32_MIN, INT32_MIN + 1, -65536, -2, -1,
+		0, 1, 2, 65535, INT32_MAX - 1, INT32_MAX };
+	int i, j;
+	int n = sizeof( edges ) / sizeof( edges[0] );
+	for( i = 0; i < n; i++ )
+		for( j = 0; j < n; j++ )
+			CheckSat( edges[i], edges[j] );
+	for( i = 0; i < 10000000; i++ )
+	{
+		uint64_t r = Rand64();
+		CheckSat( r, r >> 32 );
+	}
+	printf( "FixSatAdd, FixSatSub: ok\n" );
+}
+
+int main()
+{
+	TestMul();
+	TestMulQ();
+	TestSat();
+	TestSqrt();
+	TestDivConst();
+	printf( "All passed, %llu checks\n", (unsigned long long)checks );
+	return 0;
+}
@@ -1,5 +1,5 @@
 //
-// cnixi - ch32v003 base driver for IN-15 nixie tubes.
+// cnixi - ch32v003 base driver for IN-15 (and IN-12) nixie tubes.
 //
 // Fully integrated PI flyback PSU controller + Nixie Tube output
 // control with up to 2 channel simultaneous dimming.
@@ -16,10 +16,24 @@
 
 #include "ch32v003fun.h"
 #include <stdio.h>
+#include "tubeprofiles.h"
+#include "fixedmath.h"
+#include "ramplace.h"
+
+// RAMPLACE( fn ) puts fn in RAM (.srodata) if ramplace.h says so, otherwise
+// it's nothing.  ramplace.h is generated from a cycle profile by
+// `make placement`, see ramplace/ramplace.c.
+#define RAMPLACE_PROBE_1 ~, __attribute__((section(".srodata")))
+#define RAMPLACE_SECOND( a, b, ... ) b
+#define RAMPLACE_SELECT( probe ) RAMPLACE_SECOND( probe, , )
+#define RAMPLACE_PASTE( value ) RAMPLACE_SELECT( RAMPLACE_PROBE_##value )
+#define RAMPLACE_VALUE( value ) RAMPLACE_PASTE( value )
+#define RAMPLACE( fn ) RAMPLACE_VALUE( RAMPLACE_##fn )
 
 static uint16_t GenOnMask( int segmenton );
-static void ApplyOnMask( uint16_t onmask );
+static void ApplyOnMask( uint16_t onmask ) RAMPLACE( ApplyOnMask );
 static inline void WatchdogPet();
+static void SetHVStandby( int standby );
 
 // Limits the "ADC Set Value" in volts.
 // This prevents us from exceeding 190 volts target.
@@ -50,10 +64,51 @@ int pwm_max_duty = 48;  //This is changed based on vdd.
 // a P-only loop for quite some time without any issues.
 #define ERROR_P_TERM 2  // Actually 2^2
 #define ERROR_D_TERM -1  // Actually 2^0
-#define I_SAT_MAX (4096+2048) // SAT * 2^(-ADC_IIR+ERROR_I_TERM) = Max impact to PWM
-#define I_SAT_MIN (-4096)
 #define ERROR_I_TERM -5 // Actually 2^-6
 
+// Anti-windup.  Rather than clamping the integral at fixed limits, whatever
+// of its share of the plant is outside of what the PWM can do (0 to
+// pwm_max_duty, which moves with VDD) is taken back out, 2^-AW_TRACK_SHIFT
+// of it per sample.  And while the output is saturated, we don't integrate
+// error that would only push it further in.
+#define AW_TRACK_SHIFT 2
+
+// Setpoint preload.
+//
+// When the HV target changes, the integral is still at the old operating
+// point, and winding it over to the new one is most of the settling time.
+// So we learn the integral's share of the plant for each band of target
+// (SETPOINT_BAND_SHIFT volts wide) once the loop has settled there, and on a
+// setpoint change, start the integral from what we learned for the new one.
+// Units are the same as load_ff.
+#define SETPOINT_BAND_SHIFT 4
+#define SETPOINT_ROUND ( 1 << ( SETPOINT_BAND_SHIFT - 1 ) )
+#define SETPOINT_BANDS \
+	( ( ( ABSOLUTE_MAX_ADC_SET + SETPOINT_ROUND ) >> SETPOINT_BAND_SHIFT ) + 1 )
+#define SETPOINT_SETTLE 512    // ADC samples to wait before learning (~4ms).
+#define SETPOINT_SETTLED_ERR 8 // |err| to count as settled, lastadc units.
+#define SETPOINT_LEARN 6       // Actually 2^-6 per ADC sample.
+
+// Gain scheduling.
+//
+// The flyback's gain changes a lot between a 3.3V and a 5V supply, and
+// between a low and a high HV target, so instead of one set of gains for
+// the worst corner, there's a table by VDD band and HV target band.  Each
+// entry is three right shifts: P is applied to err << GAIN_P_PRESHIFT, I to
+// the integral and D to the derivative.  TaskGains picks the entry, and the
+// ADC interrupt switches to it, rescaling the integral so the plant doesn't
+// jump.  Every entry starts out at the gains above, tune them with
+// parameter 6 (byte 0 entry, then a nibble each of P, I and D shifts).
+#define GAIN_P_PRESHIFT 4
+#define GAIN_P_DEFAULT ( GAIN_P_PRESHIFT + ADC_IIR - (ERROR_P_TERM) )
+#define GAIN_I_DEFAULT ( ADC_IIR - (ERROR_I_TERM) )
+#define GAIN_D_DEFAULT ( ADC_IIR - (ERROR_D_TERM) )
+#define GAIN_VDD_BANDS 3
+#define GAIN_HV_BANDS 3
+#define GAIN_VDD_HYST 8   // In lastrefvdd units, ~1%.
+#define GAIN_HV_HYST 4    // In volts.
+#define GAIN_I_MIN LOAD_FF_FRAC
+
 // We filter our ADC inputs because they are kind of noisy.
 //
 // We can use Binary-shift IIR filters to filter the incoming ADC signals.
@@ -62,31 +117,272 @@ int pwm_max_duty = 48;  //This is changed based on vdd.
 #define ADC_IIR 2
 #define VDD_IIR 2
 
+// Adaptive filtering.
+//
+// A heavy IIR is quiet at steady state, but slow to follow a load step.  So
+// optionally (parameter 4, the threshold in ADC counts, 0 for off) each new
+// sample picks its own shift: _FAST if it's more than the threshold away
+// from the filtered value, _SLOW otherwise.  The filter state keeps the same
+// 2^ADC_IIR (2^VDD_IIR) scale either way, so switching doesn't jump, and the
+// PID terms don't change.
+#define ADC_IIR_FAST 1
+#define ADC_IIR_SLOW ( ADC_IIR + 2 )
+#define VDD_IIR_FAST 1
+#define VDD_IIR_SLOW ( VDD_IIR + 2 )
+
+// Oversampling.
+//
+// The ADC is only 10 bits, about 0.2-0.3V of HV per LSB.  Optionally
+// (parameter 5, 0 for off) we add up 4^n conversions per control update and
+// keep n more bits from the sum, at 1/4^n the loop rate.  The conversions
+// are still aligned to the PWM, so the ripple stays out; the ADC's own noise
+// is plenty of dither.  The filter state already has ADC_IIR (VDD_IIR)
+// fractional bits, so that's where the extra bits go, and the PID and
+// feedback math don't change.  We report ADC_FRAC fractional bits, so HV and
+// VDD come out as 12 bits (query 10), and n can't be more than that.
+#define ADC_FRAC 2
+#if ADC_FRAC > ADC_IIR || ADC_FRAC > VDD_IIR
+#error ADC_FRAC bits have to fit in the filter state
+#endif
+
+// Load feedforward.
+//
+// Every time the display changes, the load on the HV rail changes, and the
+// PID loop only finds out once the error shows up in the filtered ADC. So we
+// learn the average steady-state plant for each (cathode, brightness band)
+// display, and when the display changes, we step the integral by the
+// difference, so the loop is already about where it needs to be.
+//
+// The table is kept in plant units with LOAD_FF_FRAC fractional bits.
+#define ENABLE_LOAD_FEEDFORWARD
+#define LOAD_FF_BANDS 4
+#define LOAD_FF_FRAC 4
+#define LOAD_FF_LEARN 8      // Actually 2^-8 per ADC sample.
+#define LOAD_FF_SETTLE 256   // ADC samples to wait before learning (~2ms).
+
+// HV observer.
+//
+// The IIR on the ADC lags the real HV by a few samples, and the loop can't
+// go faster than what it sees.  So optionally (parameter 7) the PID acts on
+// a Luenberger observer's estimate instead: each control update we predict
+// from the duty we applied and a first-order model of the flyback and load,
+//   x += b * duty - a * x
+// then correct by 2^-L of the difference from the new, unfiltered, sample.
+// The flyback delivers (VDD * t_on)^2 per cycle, so the HV a duty holds goes
+// as VDD, and the ADC reads HV / VDD, so VDD drops out of the model in ADC
+// units.  a is Q16 per update, b is Q8 ADC counts (<<ADC_IIR) per duty
+// count per update.
+//
+// To identify a and b: with the observer off, settle at some HV and read the
+// duty and HV (queries 11 and 10), then set the target to 0 and time the
+// decay, tau in control updates.  a = 65536 / tau, b = x * a / ( 256 * duty )
+// with x in lastadc units.  Then, with the observer on, the average
+// innovation (query 11) should sit around 0; trim b until it does.  The
+// observer only runs while it's on, to keep its two multiplies out of the
+// ADC interrupt otherwise, and starts from lastadc, so it switches in
+// without a bump.
+#define ENABLE_HV_OBSERVER
+#define OBS_FRAC 4           // Extra fractional bits in the estimate.
+#define OBS_L_DEFAULT 2      // Correction, 2^-L of the innovation.
+#define OBS_RESIDUAL_IIR 6
+
+// Also accept commands over a half-duplex UART bus on PD5, see SetupUart.
+// #define ENABLE_UART_TRANSPORT
+
+// Enter the ADC interrupt through the core's hardware register stacking and
+// vector-table-free entry, see SetupFastAdcIrq.
+// #define ENABLE_FAST_ADC_IRQ
+
+// Time the fixedmath.h functions on the chip, see FixMathBench (query 13).
+// #define ENABLE_FIXMATH_BENCH
+
 // Target feedback, set by the user.
 int target_feedback = 0;
 
+// target_feedback with this unit's calibration applied, which is what the
+// ADC interrupt regulates to, with TARGET_FRAC fractional bits so trims
+// smaller than a volt still count.  The ADC interrupt dithers them into
+// whole volts.  See ApplyCalibration.
+#define TARGET_FRAC 4
+int target_scaled = 0;
+
 // Feedback based on what the user set and the part's VDD.
 int feedback_vdd = 0;
 
+// Power states.
+//
+// When the display is the same for the whole frame (one digit, or blank),
+// there is nothing for the main loop to do until an interrupt, so we WFI.
+// If the display stays blank for standby_ticks, we go into HV standby: The
+// flyback is held off, with the integral frozen where it was, and the
+// control loop runs at 1/HV_STANDBY_PSC of its usual rate.  We come out of
+// it as soon as something is lit again, and because the integral is still
+// at its old operating point, the rail pre-charges in a few ms.
+#define POWER_RUN 0
+#define POWER_IDLE 1
+#define POWER_STANDBY 2
+#define POWER_STATES 3
+#define HV_STANDBY_PSC 16
+
+volatile uint8_t hv_standby;
+uint32_t standby_ticks = 5000 * 6000; // 5 seconds, 0 to never standby.
+uint64_t power_ticks[POWER_STATES];
+uint8_t power_state;
+
 // Filtered ADC and VDD values.
 int lastadc = 0;
 int lastrefvdd = 0;
 
-// Code for handling numeric fading, between 2 numbers or alone.
+// Adaptive filter thresholds, in filter state units, 0 for the fixed IIR.
+int adaptive_adc;
+int adaptive_vdd;
+
+// log4 of the oversampling ratio, and the ratio itself.
+uint8_t oversample_log4;
+uint8_t oversample_count = 1;
+
+#ifdef ENABLE_HV_OBSERVER
+// Model (see above), correction shift, and whether the PID uses it.
+uint16_t obs_a;
+uint16_t obs_b;
+uint8_t obs_l = OBS_L_DEFAULT;
+uint8_t obs_on;
+// For identifying the model: the last duty, and the average innovation,
+// in lastadc units << OBS_FRAC.
+uint16_t obs_duty;
+int obs_residual;
+#endif
+
+struct Gains
+{
+	uint8_t p;
+	uint8_t i;
+	uint8_t d;
+};
+
+#define GAINS_DEFAULT { GAIN_P_DEFAULT, GAIN_I_DEFAULT, GAIN_D_DEFAULT }
+
+// [VDD band][HV band].  VDD band 0 is the highest VDD (lowest lastrefvdd).
+struct Gains gain_schedule[GAIN_VDD_BANDS * GAIN_HV_BANDS] = {
+	GAINS_DEFAULT, GAINS_DEFAULT, GAINS_DEFAULT,  // ~5V
+	GAINS_DEFAULT, GAINS_DEFAULT, GAINS_DEFAULT,  // ~4V
+	GAINS_DEFAULT, GAINS_DEFAULT, GAINS_DEFAULT,  // ~3.3V
+};
+
+// Band edges, lastrefvdd >> VDD_IIR (it goes up as VDD goes down) and volts.
+static const uint16_t gain_vdd_edges[GAIN_VDD_BANDS-1] = { 270, 330 };
+static const uint16_t gain_hv_edges[GAIN_HV_BANDS-1] = { 60, 130 };
+
+volatile uint8_t gain_next;
+volatile uint8_t gain_update;
+
+#ifdef ENABLE_LOAD_FEEDFORWARD
+#define LOAD_FF_ENTRIES ( (NUM_SEGMENTS+1)*LOAD_FF_BANDS )
+int16_t * load_ff;  // From the arena, LOAD_FF_ENTRIES long.
+volatile uint8_t load_ff_key;
+// One bit per entry, set once it has been learned.
+#define LOAD_FF_LEARNED( key ) ( load_ff_learned[(key)>>5] & ( 1u << ( (key) & 31 ) ) )
+uint32_t load_ff_learned[( LOAD_FF_ENTRIES + 31 ) / 32];
+#endif
 
-uint16_t fade_time0, fade_time1;
-uint16_t fade_disp0, fade_disp1;
+// From the arena, SETPOINT_BANDS long, with one bit per band in
+// setpoint_learned once it has been learned.
+int16_t * setpoint_preload;
+#define SETPOINT_LEARNED( band ) ( setpoint_learned & ( 1u << (band) ) )
+uint32_t setpoint_learned;
+_Static_assert( SETPOINT_BANDS <= 32, "setpoint_learned is one word" );
+volatile uint8_t setpoint_update;
 
-static uint32_t HandleFade( uint8_t fadepos )  __attribute__((section(".srodata")));
+// Code for handling numeric fading, between 2 numbers or alone, or for
+// time-multiplexing a few cathodes within one frame (i.e. digit + dot).
+//
+// The display state is double-buffered. Commands only ever write the back
+// buffer (or display_staging, see Latch), then set display_commit. AdvanceFadePlace swaps the two pointers
+// when fadepos wraps, so every frame is rendered from one consistent state,
+// no matter how many commands the host manages to squeeze into a frame.
+//
+// Each entry is lit while fadepos < fade_time[n] (and it was not claimed by
+// an earlier entry), so the end times must be ascending.  Unused entries
+// have a time of 0.
+#define DISPLAY_ENTRIES 3
+
+struct DisplayState
+{
+	uint16_t fade_time[DISPLAY_ENTRIES];
+	uint16_t fade_disp[DISPLAY_ENTRIES];
+	uint16_t lit_slots;  // How many of the 256 slots have anything on.
+	uint8_t is_static;   // The same mask the whole frame (so we can sleep).
+#ifdef ENABLE_LOAD_FEEDFORWARD
+	uint8_t ff_key;
+#endif
+};
+
+// How many of the 256 slots in a frame cathodes may be lit in total. This is
+// effectively a cap on the average cathode current.  256 = always allowed.
+int cathode_budget = 256;
+
+struct DisplayState display_states[2];
+struct DisplayState * volatile display_front = &display_states[0];
+struct DisplayState * volatile display_back = &display_states[1];
+
+// DISPLAY_COMMIT_FRAME waits for fadepos to wrap, DISPLAY_COMMIT_NOW is for
+// latched (staged) updates, which should flip as soon as they are told to.
+#define DISPLAY_COMMIT_FRAME 1
+#define DISPLAY_COMMIT_NOW 2
+volatile uint8_t display_commit;
+
+// Staged commands (0x6x instead of 0x4x) fill display_staging, and wait for
+// a latch command (command 10) to show, so a whole row of tubes can flip at
+// once, no matter how long it took to send everyone their digits.  Plain
+// commands in between show as usual and keep away from display_staging, so
+// the staged content still flips with the others.  When the latch fires,
+// the staged content replaces whatever is showing, or written but not
+// shown yet.
+#define LATCH_NOW 0
+#define LATCH_AUX_EDGE 1  // On the next rising edge on PD7 (DIG_AUX).
+#define LATCH_AT_TIME 2   // When (SysTick->CNT>>8) gets to a 20-bit time.
+volatile uint8_t display_staged;
+struct DisplayState display_staging;
+volatile uint8_t latch_time_armed;
+volatile uint32_t latch_time;
+
+// Time sync.
+//
+// Every tube's fade clock is its own SysTick, off its own HSI, so tubes next
+// to each other drift apart.  The host sends reference timestamps (in 6MHz
+// SysTick ticks) with command 11.  From those we keep an offset from SysTick
+// to "display time", which is what fades and latches run on, fix large rate
+// errors with the HSI trim, and what is left with a slow rate correction
+// applied every command tick.
+//
+// Without the sequenced protocol's ext, the reference is only 24 bits, and
+// wraps every ~2.8s, so then we only compare the low 24 bits.  The upper
+// bits of display time are whatever they were when we first locked, so for
+// LATCH_AT_TIME across tubes, either send the full time in ext, or sync
+// them all within the same 2^24 ticks.
+#define TIME_SYNC_LOCK_RANGE ( 1<<20 )  // Errors bigger than this re-lock.
+#define TIME_SYNC_MIN_TRIM_TICKS ( 6000000 ) // 1s between trim changes.
+#define TIME_SYNC_TRIM_STEP_PPM 2500         // About what one HSITRIM step is.
+
+volatile int32_t clock_offset;
+int32_t clock_rate;       // 2^-16 ticks per command tick.
+uint32_t clock_rate_frac;
+uint8_t clock_locked;
+
+// lit_slots of the front buffer, i.e. overall display brightness.
+volatile uint16_t display_lit;
+volatile uint8_t display_static;
+
+static uint32_t HandleFade( uint8_t fadepos ) RAMPLACE( HandleFade );
 static uint32_t HandleFade( uint8_t fadepos )
 {
-	// Digit fade.  Use fade_timeX and fade_dispX to handle fade logic.
-	if( fadepos < fade_time0 )
-		return fade_disp0;
-	else if( fadepos < fade_time1 ) 
-		return fade_disp1;
-	else
-		return 0;
+	// Digit fade.  Use fade_time and fade_disp to handle fade logic.
+	struct DisplayState * ds = display_front;
+	int i;
+	for( i = 0; i < DISPLAY_ENTRIES; i++ )
+		if( fadepos < ds->fade_time[i] )
+			return ds->fade_disp[i];
+	return 0;
 }
 
 static inline uint32_t FastMultiply( uint32_t big_num, uint32_t small_num );
@@ -150,15 +446,41 @@ static inline uint32_t FastMultiply( uint32_t big_num, uint32_t small_num )
 // FYI You can use functions in ram to make them work faster.  The .srodata
 // attribute. This means this function gets placed into RAM. Normally this
 // function takes approximately 2.5-3us to execute from flash, but only 2-2.5us
-// to execute from RAM.
-
+// to execute from RAM.  Which functions go in RAM is decided by ramplace.h,
+// see RAMPLACE.
+
+#ifdef ENABLE_FAST_ADC_IRQ
+// With the fast path, the body is a plain function, and the interrupt entry
+// points call it, see SetupFastAdcIrq.  It's only called from asm, so the
+// compiler has to be told to keep it, and not to fold it into a caller.
+void AdcIsrBody(void)
+	__attribute__((used, noinline))
+	RAMPLACE( AdcIsrBody );
+
+// Where TIM1 was when we got into AdcIsrBody, per entry path (0 = through
+// the vector table, 1 = VTF), IIR'd, in 1/16 cycles.  The ADC is triggered
+// by TIM1, and the conversion takes the same time either way, so the
+// difference between the two is what we save on every entry.
+uint32_t adc_entry_phase[2];
+volatile uint8_t adc_fast_path;
+#else
 // This is an interrupt called by an ADC conversion.
 void ADC1_IRQHandler(void)
 	__attribute__((interrupt))
-	__attribute__((section(".srodata")));
+	RAMPLACE( ADC1_IRQHandler );
+#define AdcIsrBody ADC1_IRQHandler
+#endif
 
-void ADC1_IRQHandler(void)
+void AdcIsrBody(void)
 {
+#ifdef ENABLE_FAST_ADC_IRQ
+	int entry_phase = TIM1->CNT;
+
+	// Before anything can return early, e.g. while oversampling.
+	uint32_t * phase = &adc_entry_phase[adc_fast_path];
+	*phase += entry_phase - ( *phase >> 4 );
+#endif
+
 	// If you want to see how long this functon takes to run, you can use a
 	// scope and then monitor pin D6 if you uncomment this and the bottom copy.
 	GPIOD->BSHR = 1<<6;
@@ -178,10 +500,76 @@ void ADC1_IRQHandler(void)
 	// 2^VDD_IIR bigger)
 
 	int adcraw = ADC1->RDATAR;
-	int newadc = adcraw + (lastadc - (lastadc>>ADC_IIR));
+	int vddraw = ADC1->IDATAR1;
+
+	// The new readings, in the filter's units (2^ADC_IIR, 2^VDD_IIR per LSB).
+	int adcsample = adcraw << ADC_IIR;
+	int vddsample = vddraw << VDD_IIR;
+
+	int log4 = oversample_log4;
+	if( log4 )
+	{
+		// Accumulate until we have 4^n, then the sum is 2n bits bigger, of
+		// which n bits are real.
+		static int os_count, os_adc, os_vdd;
+		os_adc += adcraw;
+		os_vdd += vddraw;
+		if( ++os_count < oversample_count )
+		{
+			GPIOD->BSHR = (1<<(16+6));
+			return;
+		}
+		adcsample = ( os_adc << ADC_IIR ) >> ( log4 * 2 );
+		vddsample = ( os_vdd << VDD_IIR ) >> ( log4 * 2 );
+		os_count = os_adc = os_vdd = 0;
+	}
+
+	int newadc;
+	if( adaptive_adc || log4 )
+	{
+		// Same filter, but written as state += ( sample - state ) / 2^shift
+		// so the shift can change per sample, and the sample can have
+		// fractional bits.  Rounded, or the shift's floor would leave the
+		// state sitting low by up to 2^shift.  The shifts are all >= 1.
+		int delta = adcsample - lastadc;
+		int shift = ( adaptive_adc &&
+			( delta > adaptive_adc || -delta > adaptive_adc ) ) ?
+			ADC_IIR_FAST : adaptive_adc ? ADC_IIR_SLOW : ADC_IIR;
+		newadc = lastadc + ( ( delta + ( 1 << ( shift - 1 ) ) ) >> shift );
+	}
+	else
+		newadc = adcraw + (lastadc - (lastadc>>ADC_IIR));
 	lastadc = newadc;
 
-	int err = feedback_vdd - lastadc;
+#ifdef ENABLE_HV_OBSERVER
+	// Predict from what we drove last time, then correct from the sample.
+	// The products stay in 32 bits: the estimate is at most 16 bits, and so
+	// are a and b.
+	static int obs_x;
+	static uint8_t obs_running;
+	int hv = lastadc;
+	if( !obs_on )
+		obs_running = 0;
+	else
+	{
+		if( !obs_running )
+		{
+			obs_x = lastadc << OBS_FRAC;
+			obs_running = 1;
+		}
+		obs_x += ( FastMultiply( obs_b, obs_duty ) >> ( 8 - OBS_FRAC ) ) -
+			( FastMultiply( obs_x, obs_a ) >> 16 );
+		int innovation = ( adcsample << OBS_FRAC ) - obs_x;
+		obs_x += innovation >> obs_l;
+		obs_x = ( obs_x < 0 ) ? 0 : obs_x;
+		obs_residual += ( innovation - obs_residual ) >> OBS_RESIDUAL_IIR;
+		hv = obs_x >> OBS_FRAC;
+	}
+#else
+	int hv = lastadc;
+#endif
+
+	int err = hv_standby ? 0 : feedback_vdd - hv;
 
 	static int integral;
 	static int lasterr;
@@ -189,23 +577,129 @@ void ADC1_IRQHandler(void)
 	lasterr = err;
 	integral += err;
 
-	// We asymmetrically allow the integral to saturate, to help prevent long-
-	// term oscillations.
-	integral = ( integral > ((I_SAT_MAX)<<ADC_IIR) ) ? ((I_SAT_MAX)<<ADC_IIR) : integral;
-	integral = ( integral < ((I_SAT_MIN)<<ADC_IIR) ) ? ((I_SAT_MIN)<<ADC_IIR) : integral;
+	// The gains in use.
+	static int gain_p = GAIN_P_DEFAULT;
+	static int gain_i = GAIN_I_DEFAULT;
+	static int gain_d = GAIN_D_DEFAULT;
+	if( gain_update )
+	{
+		// Switch gains without a bump in plant: keep the integral's share
+		// the same by shifting it with the I gain, then make up for the
+		// change in P and D with it too.  Rare, so it can be slow-ish.
+		struct Gains * g = &gain_schedule[gain_next];
+		int pd_old = ( ( err << GAIN_P_PRESHIFT ) >> gain_p ) +
+			( derivative >> gain_d );
+		int pd_new = ( ( err << GAIN_P_PRESHIFT ) >> g->p ) +
+			( derivative >> g->d );
+		integral = ( g->i > gain_i ) ? integral << ( g->i - gain_i ) :
+			integral >> ( gain_i - g->i );
+		integral += ( pd_old - pd_new ) << g->i;
+		gain_p = g->p;
+		gain_i = g->i;
+		gain_d = g->d;
+		gain_update = 0;
+	}
+
+#ifdef ENABLE_LOAD_FEEDFORWARD
+	// If the display just changed, step the integral by the difference in
+	// learned plant between the old and the new display.  Only if we've
+	// learned both, else we'd step by the whole of the one we know.
+	static int ff_lastkey;
+	static int ff_settle;
+	int ff_key = load_ff_key;
+	if( ff_key != ff_lastkey )
+	{
+		if( LOAD_FF_LEARNED( ff_key ) && LOAD_FF_LEARNED( ff_lastkey ) )
+			integral += ( load_ff[ff_key] - load_ff[ff_lastkey] ) <<
+				( gain_i - LOAD_FF_FRAC );
+		ff_lastkey = ff_key;
+		ff_settle = LOAD_FF_SETTLE;
+	}
+#endif
+
+	// If the target just changed, start the integral where it ended up last
+	// time we were at this target, if we've been there.
+	static int sp_band;
+	static int sp_settle;
+	if( setpoint_update )
+	{
+		sp_band = ( target_feedback + SETPOINT_ROUND ) >> SETPOINT_BAND_SHIFT;
+		if( SETPOINT_LEARNED( sp_band ) )
+			integral = setpoint_preload[sp_band] << ( gain_i - LOAD_FF_FRAC );
+		sp_settle = SETPOINT_SETTLE;
+		setpoint_update = 0;
+	}
+
+	// Back-calculation: pull the integral's share back inside the range of
+	// the PWM.  This is dynamic, so there is no fixed limit to wind through
+	// after a big step.
+	int i_share = integral >> gain_i;
+	int i_over = ( i_share > pwm_max_duty ) ? i_share - pwm_max_duty :
+		( i_share < 0 ) ? i_share : 0;
+	integral -= ( i_over << gain_i ) >> AW_TRACK_SHIFT;
 
 	// This is the heart of the PID loop.
 	// General note about shifting: Be sure to combine your shifts.
 	// If you shift right, then left, you will lose bits of precision.
-	// These shifts turn into single left and right immediate shifts.
+	// The gains come from the gain schedule, so these are register shifts,
+	// still one instruction each.
 	int plant = 
-		(err << ( (-ADC_IIR) + (ERROR_P_TERM) )) +
-		(integral >> ( ADC_IIR - (ERROR_I_TERM) )) +
-		(derivative >> ( (ADC_IIR) - (ERROR_D_TERM) ) );
+		((err << GAIN_P_PRESHIFT) >> gain_p) +
+		(integral >> gain_i) +
+		(derivative >> gain_d);
+
+	// Conditional integration: if we're saturated and the error would push
+	// us further in, this sample's error shouldn't have been integrated.
+	if( ( plant > pwm_max_duty && err > 0 ) || ( plant < 0 && err < 0 ) )
+		integral -= err;
+
 	plant = ( plant > pwm_max_duty ) ? pwm_max_duty : plant;
-	plant = ( plant < 0 ) ? 0 : plant;
+	plant = ( plant < 0 || hv_standby ) ? 0 : plant;
 	TIM1->CH2CVR = plant;
 
+	// Learn the integral for this target, but only once we've been within
+	// SETPOINT_SETTLED_ERR of it for SETPOINT_SETTLE samples in a row, so
+	// transients (display changes, standby) don't get learned too.
+	if( err > SETPOINT_SETTLED_ERR || -err > SETPOINT_SETTLED_ERR )
+		sp_settle = SETPOINT_SETTLE;
+	else if( sp_settle )
+		sp_settle--;
+	else if( !hv_standby )
+	{
+		int16_t * learned = &setpoint_preload[sp_band];
+		int now = integral >> ( gain_i - LOAD_FF_FRAC );
+		if( SETPOINT_LEARNED( sp_band ) )
+			*learned += ( now - *learned ) >> SETPOINT_LEARN;
+		else
+		{
+			*learned = now;
+			setpoint_learned |= 1u << sp_band;
+		}
+	}
+#ifdef ENABLE_HV_OBSERVER
+	obs_duty = plant;
+#endif
+
+#ifdef ENABLE_LOAD_FEEDFORWARD
+	// Once things settled after a display change, learn the plant needed for
+	// this display with a slow IIR, starting from the first settled plant.
+	// Coming out of standby counts as a change too.
+	if( hv_standby )
+		ff_settle = LOAD_FF_SETTLE;
+	else if( ff_settle )
+		ff_settle--;
+	else
+	{
+		if( LOAD_FF_LEARNED( ff_key ) )
+			load_ff[ff_key] += ( (plant<<LOAD_FF_FRAC) - load_ff[ff_key] ) >> LOAD_FF_LEARN;
+		else
+		{
+			load_ff[ff_key] = plant<<LOAD_FF_FRAC;
+			load_ff_learned[ff_key>>5] |= 1u << ( ff_key & 31 );
+		}
+	}
+#endif
+
 	// Use injection channel data to read vref.  This is needed because we
 	// measure all values WRT to VDD and GND.  So we need to measure the vref
 	// a lot to make sure we know what value we are are targeting Ballparks
@@ -214,7 +708,17 @@ void ADC1_IRQHandler(void)
 	//	 0x175 / 373 for 3.3v input << lastrefvdd
 
 	// Do an IIR low-pass filter on VDD. See IIR discussion above.
-	uint32_t vdd = lastrefvdd = ADC1->IDATAR1 + (lastrefvdd - (lastrefvdd>>VDD_IIR));
+	if( adaptive_vdd || log4 )
+	{
+		int delta = vddsample - lastrefvdd;
+		int shift = ( adaptive_vdd &&
+			( delta > adaptive_vdd || -delta > adaptive_vdd ) ) ?
+			VDD_IIR_FAST : adaptive_vdd ? VDD_IIR_SLOW : VDD_IIR;
+		lastrefvdd += ( delta + ( 1 << ( shift - 1 ) ) ) >> shift;
+	}
+	else
+		lastrefvdd = vddraw + (lastrefvdd - (lastrefvdd>>VDD_IIR));
+	uint32_t vdd = lastrefvdd;
 
 #ifndef ENABLE_TUNING
 
@@ -289,8 +793,18 @@ void ADC1_IRQHandler(void)
 	// write it out manually, we can get even faster!
 	//
 	//	uint32_t numerator = (vdd * target_feedback);
-
-	uint32_t numerator = FastMultiply( vdd, target_feedback );
+	//
+	// We use target_scaled, which has the per-unit calibration folded in
+	// already.  So the multiply still only loops over the 8 bits of whole
+	// volts, its fraction is dithered in: we carry the remainder from one
+	// sample to the next, so on average, which is all the integral sees,
+	// we regulate to exactly target_scaled.  That's a few instructions,
+	// where looping over vdd's 10-11 bits instead would be 2-3 iterations.
+	static int target_dither;
+	target_dither = ( target_dither & ( ( 1 << TARGET_FRAC ) - 1 ) ) +
+		target_scaled;
+
+	uint32_t numerator = FastMultiply( vdd, target_dither >> TARGET_FRAC );
 
 	feedback_vdd =
 		(numerator>>(7+VDD_IIR-ADC_IIR)) +
@@ -302,6 +816,50 @@ void ADC1_IRQHandler(void)
 	GPIOD->BSHR = (1<<(16+6));
 }
 
+#ifdef ENABLE_FAST_ADC_IRQ
+// The QingKe V2 core can push the caller-saved registers in hardware on
+// interrupt entry, and pop them on mret (HPE), and it can jump straight to a
+// handler for up to two IRQs without a vector table lookup (VTF).  With both,
+// the entry point is just a call and an mret, and the body only saves the
+// registers it uses on top of that, like any other function.
+//
+// The hardware stack is only two deep, which is fine because only SysTick
+// and TIM2 (at 1<<7) can be preempted, and only by the ADC or EXTI (at 0).
+void AdcFastEntry(void)
+	__attribute__((naked))
+	RAMPLACE( AdcFastEntry );
+
+void AdcFastEntry(void)
+{
+	__asm__ volatile( "call AdcIsrBody\n\tmret" );
+}
+
+// The vector table entry is still there for when VTF is switched off (see
+// parameter 3), so the two can be compared.
+void ADC1_IRQHandler(void)
+	__attribute__((interrupt))
+	RAMPLACE( ADC1_IRQHandler );
+
+void ADC1_IRQHandler(void)
+{
+	AdcIsrBody();
+}
+
+static void SetFastAdcPath( int fast )
+{
+	adc_fast_path = fast;
+	NVIC->VTFADDR[0] = (uint32_t)AdcFastEntry | ( fast ? 1 : 0 );
+}
+
+static void SetupFastAdcIrq()
+{
+	// INTSYSCR: HWSTKEN, hardware prologue/epilogue.
+	__asm__ volatile( "csrs 0x804, %0" : : "r"(1) );
+	NVIC->VTFIDR[0] = ADC_IRQn;
+	SetFastAdcPath( 1 );
+}
+#endif
+
 static void SetupTimer1()
 {
 	// Enable Timer 1
@@ -325,6 +883,83 @@ static void SetupTimer1()
 	TIM1->CTLR1 = TIM_CEN;
 }
 
+// Aux neon effects.
+//
+// Anything other than a static duty runs from the TIM2 update interrupt,
+// (48MHz / 33 / 256 = ~5.7kHz), so the host only has to send one command
+// to get a breathing or blinking neon. The ISR is only enabled while an
+// effect is running.
+#define AUX_EFFECT_STATIC 0
+#define AUX_EFFECT_BREATHE 1  // Triangle 0..level, rate sets the speed.
+#define AUX_EFFECT_BLINK 2    // param/256 of the time at level.
+#define AUX_EFFECT_RAMP 3     // Move towards level, (1<<rate)/256 per tick.
+#define AUX_EFFECT_FOLLOW 4   // Level scaled by main display brightness.
+
+uint8_t aux_effect;
+uint8_t aux_rate;
+uint8_t aux_level;
+uint8_t aux_param;
+uint16_t aux_phase;
+uint16_t aux_ramp;  // 8.8 fixed point current level for AUX_EFFECT_RAMP.
+
+void TIM2_IRQHandler(void) __attribute__((interrupt)) RAMPLACE( TIM2_IRQHandler );
+void TIM2_IRQHandler(void)
+{
+	// The only interrupt we enable on TIM2 is update.
+	TIM2->INTFR = 0;
+
+	uint32_t phase = aux_phase += ( 1 << aux_rate );
+	uint32_t duty = 0;
+
+	switch( aux_effect )
+	{
+	case AUX_EFFECT_BREATHE:
+	{
+		uint32_t tri = phase >> 7;
+		tri = ( tri < 256 ) ? tri : 511 - tri;
+		duty = FastMultiply( aux_level, tri ) >> 8;
+		break;
+	}
+	case AUX_EFFECT_BLINK:
+		duty = ( (phase >> 8) < aux_param ) ? aux_level : 0;
+		break;
+	case AUX_EFFECT_RAMP:
+	{
+		int target = aux_level << 8;
+		int cur = aux_ramp;
+		int step = 1 << aux_rate;
+		if( cur < target )
+			cur = ( cur + step > target ) ? target : cur + step;
+		else
+			cur = ( cur - step < target ) ? target : cur - step;
+		aux_ramp = cur;
+		duty = cur >> 8;
+		break;
+	}
+	case AUX_EFFECT_FOLLOW:
+		duty = FastMultiply( aux_level, display_lit ) >> 8;
+		break;
+	}
+
+	TIM2->CH4CVR = duty;
+}
+
+static void SetAuxEffect( int effect, int rate, int level, int param )
+{
+	TIM2->DMAINTENR = 0;
+
+	aux_rate = rate;
+	aux_level = level;
+	aux_param = param;
+	aux_ramp = TIM2->CH4CVR << 8;
+	aux_effect = effect;
+
+	if( effect == AUX_EFFECT_STATIC )
+		TIM2->CH4CVR = level;
+	else
+		TIM2->DMAINTENR = TIM_UIE;
+}
+
 static void SetupTimer2()
 {
 	// Enable Timer 2
@@ -336,10 +971,15 @@ static void SetupTimer2()
 
 	TIM2->PSC = 0x0020;
 	TIM2->ATRLR = 255;				// 0..255 (So we can be 100% on)
-	TIM2->CHCTLR2 = TIM_OC4M_2 | TIM_OC4M_1;
+	TIM2->CHCTLR2 = TIM_OC4M_2 | TIM_OC4M_1 | TIM_OC4PE; // Preload, no glitches.
 	TIM2->CCER = TIM_CC4E;
 	TIM2->CH4CVR = 0;  			// Actual duty cycle (Off to begin with)
 
+	// Effects are less important than the flyback, so they run at the lower
+	// priority level.
+	NVIC_SetPriority( TIM2_IRQn, 1<<7 );
+	NVIC_EnableIRQ( TIM2_IRQn );
+
 	// Enable TIM1 outputs
 	TIM2->BDTR = TIM_MOE;
 	TIM2->CTLR1 = TIM_CEN;
@@ -400,7 +1040,7 @@ static void SetupADC()
 // Apply a given output mask to the GPIO ports the nixie tubes are hooked into.
 static void ApplyOnMask( uint16_t onmask )
 {
-	GPIOD->OUTDR = (onmask >> 8) | 0x80;
+	GPIOD->OUTDR = (onmask >> 8) | BOARD_GPIOD_OUTDR;
 	GPIOC->OUTDR = onmask & 0xff;
 }
 
@@ -408,33 +1048,730 @@ uint16_t GenOnMask( int segmenton )
 {
 	// Produce a bit mask with only one bit on. To indicate the IO to turn on
 	// to light up a given segment.  If segmenton == 0, then all IO are off.
-	if( segmenton > 0 )
-	{
-		segmenton--;
-		if( segmenton < 8 )
-			return 1<<segmenton;
-		else if( segmenton == 8 )
-			return (1<<2)<<8;
-		else if( segmenton == 9 )
-			return (1<<3)<<8;
-		else if( segmenton == 10 )
-			return (1<<0)<<8;
-		else if( segmenton == 11 )
-			return (1<<7)<<8;
+	// The table comes from the tube profile in tubeprofiles.h.
+	if( (unsigned)segmenton > NUM_SEGMENTS )
+		return 0;
+	return tube_segment_masks[segmenton];
+}
+
+static void CommitDisplayState( struct DisplayState * ds, int segment, int staged )
+{
+	// Count how many of the slots have anything lit.
+	int i;
+	int prev = 0;
+	int on = 0;
+	for( i = 0; i < DISPLAY_ENTRIES; i++ )
+	{
+		int t = ds->fade_time[i];
+		if( t > 256 ) t = 256;
+		if( t <= prev ) continue;
+		if( ds->fade_disp[i] ) on += t - prev;
+		prev = t;
+	}
+	ds->lit_slots = on;
+	ds->is_static = !on || ds->fade_time[0] >= 256;
+
+#ifdef ENABLE_LOAD_FEEDFORWARD
+	// Figure out which load feedforward entry this display state uses, from
+	// its main cathode and brightness.
+	int band = on >> 6;
+	if( band >= LOAD_FF_BANDS ) band = LOAD_FF_BANDS - 1;
+	if( segment > NUM_SEGMENTS || !on ) segment = 0;
+	ds->ff_key = segment * LOAD_FF_BANDS + band;
+#endif
+	if( staged )
+		display_staged = 1;
+	else if( display_commit != DISPLAY_COMMIT_NOW )
+		display_commit = DISPLAY_COMMIT_FRAME;
+}
+
+static void SetupAuxPin( int latch )
+{
+	// DIG_AUX (PD7) is normally the TIM2 CH4 output for the aux neon.  While
+	// we wait for a latch edge, it is an input instead.
+	GPIOD->CFGLR &= ~(0xf<<(4*7));
+	if( latch )
+	{
+		GPIOD->CFGLR |= (GPIO_CNF_IN_FLOATING)<<(4*7);
+		AFIO->EXTICR = ( AFIO->EXTICR & ~(3<<(7*2)) ) | (3<<(7*2)); // Port D
+		EXTI->INTFR = 1<<7;
+		EXTI->RTENR |= 1<<7;
+		EXTI->INTENR |= 1<<7;
+		NVIC_EnableIRQ( EXTI7_0_IRQn );
+	}
+	else
+	{
+		EXTI->INTENR &= ~(1<<7);
+		GPIOD->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP_AF)<<(4*7);
+	}
+}
+
+void EXTI7_0_IRQHandler(void) __attribute__((interrupt));
+void EXTI7_0_IRQHandler(void)
+{
+	EXTI->INTFR = 1<<7;
+	display_commit = DISPLAY_COMMIT_NOW;
+	SetupAuxPin( 0 );
+}
+
+static void Latch( int mode, uint32_t when )
+{
+	if( !display_staged ) return;
+	display_staged = 0;
+
+	switch( mode )
+	{
+	case LATCH_NOW:
+		display_commit = DISPLAY_COMMIT_NOW;
+		break;
+	case LATCH_AUX_EDGE:
+		SetupAuxPin( 1 );
+		break;
+	case LATCH_AT_TIME:
+		latch_time = when & 0xfffff;
+		latch_time_armed = 1;
+		break;
 	}
+}
+
+// Anything a command wants to send back beyond the status word.  This goes
+// to the host in DMDATA1.
+uint32_t command_reply;
+
+// Command ring.
+//
+// For bulk transfers, the host can skip the mailbox, and write a whole batch
+// of command words straight into RAM with debugger block writes.  Find it by
+// asking for query 0 (./minichlink -s 0x04 0x00000049, then DMDATA1 has the
+// address), or by looking for the magic.  Indices wrap at the ring size.
+// The host owns head, we own tail.  Write the commands first, then head.
+// The ring is empty when head == tail, and full at head + 1 == tail.  Each
+// index has a word to itself: debugger writes are word sized, so a head
+// write would otherwise also write back a stale tail.
+#define COMMAND_RING_SIZE 32  // Must be a power of 2.
+#define COMMAND_RING_BURST 4  // Most commands we run per main loop pass.
+#define COMMAND_RING_MAGIC 0x52584e43  // "CNXR"
+
+struct CommandRing
+{
+	uint32_t magic;
+	uint16_t size;
+	uint16_t reserved;
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint32_t commands[COMMAND_RING_SIZE];
+};
+
+struct CommandRing command_ring = { COMMAND_RING_MAGIC, COMMAND_RING_SIZE };
+
+// Command slots, for the pipelined protocol, see PollDebugMailbox.  The
+// host writes slot[seq & (COMMAND_SLOTS-1)] with debugger block writes, and
+// we leave each command's reply next to it.  Find it with query 12, which
+// also restarts the numbering, so the host's first slot is sequence 0.  The
+// restart waits for the next doorbell, so a query 12 in a slot doesn't send
+// the doorbell loop back over the slots before it.
+#define COMMAND_SLOTS 8  // Must be a power of 2, 16 at most.
+#define COMMAND_SLOTS_MAGIC 0x534c4e43  // "CNLS"
+
+struct CommandSlot
+{
+	volatile uint32_t word;
+	volatile uint32_t ext;
+	volatile uint32_t reply;
+};
+
+struct CommandSlots
+{
+	uint32_t magic;
+	struct CommandSlot slot[COMMAND_SLOTS];
+};
+
+struct CommandSlots command_slots = { COMMAND_SLOTS_MAGIC };
+uint8_t command_slot_seq = 0xf;  // The last one we ran.
+volatile uint8_t command_slot_restart;  // Set by query 12.
+
+#ifdef ENABLE_UART_TRANSPORT
+// Our node address on the UART bus, see SetupUart.
+uint8_t uart_address = 1;
+#endif
+
+// Commands are picked up by the SysTick compare interrupt, at the lower
+// priority level, so the flyback ISR can still preempt it, but the main loop
+// can't hold them up.  Worst case response is COMMAND_POLL_TICKS plus the
+// time the command takes to run.
+//
+// We keep a histogram of how long it was from the poll before the one that
+// found a command, to when that command was done.  That is the worst case
+// any given command could have seen.
+#define COMMAND_POLL_TICKS 600  // SysTick is HCLK/8 = 6MHz, so 100us.
+#define LATENCY_BUCKETS 16
+#define LATENCY_BUCKET_SHIFT 6  // 64 ticks, ~10.7us per bucket.
+
+uint16_t * latency_histogram;  // From the arena, LATENCY_BUCKETS long.
+uint32_t latency_max;
+
+static void RecordLatency( uint32_t ticks )
+{
+	int bucket = ticks >> LATENCY_BUCKET_SHIFT;
+	if( bucket >= LATENCY_BUCKETS ) bucket = LATENCY_BUCKETS - 1;
+	if( ticks > latency_max ) latency_max = ticks;
+
+	// Halve everything when we run out of counts, so the percentiles still
+	// work, but favor recent history.
+	if( latency_histogram[bucket] == 0xffff )
+	{
+		int i;
+		for( i = 0; i < LATENCY_BUCKETS; i++ )
+			latency_histogram[i] >>= 1;
+	}
+	latency_histogram[bucket]++;
+}
+
+// Task scheduler.
+//
+// Background jobs live in this table, instead of being bolted onto the main
+// loop.  The SysTick interrupt releases each one every period command ticks
+// and the main loop runs whatever was released, in table order.  We keep
+// each task's runtime, and count an overrun if it finishes later than its
+// deadline after its release, or is released again before it ran at all.
+// When nothing is released, the main loop can sleep.
+struct Task
+{
+	void (*run)();
+	uint16_t period;        // In command ticks, COMMAND_POLL_TICKS each.
+	uint16_t deadline;      // In SysTick ticks after release.
+	uint16_t countdown;
+	volatile uint8_t pending;
+	uint16_t overruns;
+	uint16_t runtime_last;  // In SysTick ticks.
+	uint16_t runtime_max;
+	uint32_t released;
+};
+
+static void TaskStandby();
+static void TaskConfig();
+static void TaskGains();
+
+struct Task tasks[] = {
+	{ TaskStandby, 100, 6000 },  // Every 10ms, done within 1ms.
+	{ TaskConfig, 100, 60000 },  // Every 10ms, flash writes take a few ms.
+	{ TaskGains, 100, 6000 },    // Every 10ms, done within 1ms.
+};
+
+#define NUM_TASKS ( sizeof(tasks) / sizeof(tasks[0]) )
+
+static void ReleaseTasks( uint32_t now )
+{
+	int i;
+	for( i = 0; i < NUM_TASKS; i++ )
+	{
+		struct Task * t = &tasks[i];
+		if( t->countdown && --t->countdown ) continue;
+		t->countdown = t->period;
+		if( t->pending ) t->overruns++;
+		t->released = now;
+		t->pending = 1;
+	}
+}
+
+static int TasksPending()
+{
+	int i;
+	for( i = 0; i < NUM_TASKS; i++ )
+		if( tasks[i].pending ) return 1;
 	return 0;
 }
 
-static void HandleCommand( uint32_t dmdword )
+static void RunTasks()
+{
+	int i;
+	for( i = 0; i < NUM_TASKS; i++ )
+	{
+		struct Task * t = &tasks[i];
+		if( !t->pending ) continue;
+		t->pending = 0;
+
+		uint32_t start = SysTick->CNT;
+		t->run();
+		uint32_t end = SysTick->CNT;
+
+		uint32_t runtime = end - start;
+		if( runtime > 0xffff ) runtime = 0xffff;
+		t->runtime_last = runtime;
+		if( runtime > t->runtime_max ) t->runtime_max = runtime;
+		if( end - t->released > t->deadline ) t->overruns++;
+	}
+}
+
+#ifdef ENABLE_FIXMATH_BENCH
+// Cycles per call of each fixedmath.h function, with typical operands for
+// how we use them, from SysTick (8 cycles per tick) over FIXMATH_BENCH_RUNS
+// calls.  Includes the loop and the volatile loads, ~6 cycles, so compare
+// against run 0, which is just that.
+#define FIXMATH_BENCH_RUNS 256
+volatile uint32_t bench_a = 12345, bench_b = 180, bench_x = 123456;
+
+static uint32_t FixMathBench( int which )
+{
+	volatile uint32_t sink;
+	uint32_t start = SysTick->CNT;
+	int i;
+	for( i = 0; i < FIXMATH_BENCH_RUNS; i++ )
+	{
+		switch( which )
+		{
+		case 0: sink = bench_a; break;
+		case 1: sink = FixMul( bench_a, bench_b ); break;
+		case 2: sink = FixMulQ( bench_a, bench_b << 8 | 0x55, 8 ); break;
+		case 3: sink = FixSatAdd( bench_a, bench_b ); break;
+		case 4: sink = FixDivConst( bench_a, 6 ); break;
+		case 5: sink = FixSqrt( bench_x ); break;
+		}
+	}
+	(void)sink;
+	return ( ( SysTick->CNT - start ) * 8 ) / FIXMATH_BENCH_RUNS;
+}
+#endif
+
+static uint32_t LatencyPercentiles()
+{
+	// Returns p50, p90, p99 and max, in microseconds, one per byte, from
+	// the LSB up.  Percentiles are the top edge of their bucket. Slow path,
+	// so we can use multiplies and divides.
+	static const uint8_t percent[3] = { 50, 90, 99 };
+	uint32_t total = 0;
+	uint32_t ret = 0;
+	int i, p;
+
+	for( i = 0; i < LATENCY_BUCKETS; i++ )
+		total += latency_histogram[i];
+
+	for( p = 0; p < 3; p++ )
+	{
+		uint32_t threshold = ( total * percent[p] + 99 ) / 100;
+		uint32_t sum = 0;
+		for( i = 0; i < LATENCY_BUCKETS - 1; i++ )
+		{
+			sum += latency_histogram[i];
+			if( sum >= threshold ) break;
+		}
+		uint32_t us = FixDivConst( ( i + 1 ) << LATENCY_BUCKET_SHIFT, 6 );
+		ret |= ( ( us > 255 ) ? 255 : us ) << ( p * 8 );
+	}
+
+	uint32_t maxus = ( latency_max >= 256 * 6 ) ? 255 :
+		FixDivConst( latency_max, 6 );
+	ret |= ( ( maxus > 255 ) ? 255 : maxus ) << 24;
+	return ret;
+}
+
+static void TimeSync( uint32_t reference, int bits )
+{
+	// Slow path, so we can divide here.
+	static uint32_t last_local;
+	static uint32_t last_trim;
+	uint32_t local = SysTick->CNT;
+	int32_t err = reference - ( local + clock_offset );
+
+	// Only the bits we were given count, sign extended from there.
+	err = (int32_t)( (uint32_t)err << ( 32 - bits ) ) >> ( 32 - bits );
+
+	if( !clock_locked || err > TIME_SYNC_LOCK_RANGE || err < -TIME_SYNC_LOCK_RANGE )
+	{
+		// Just jump there.  Once locked, keep the bits we weren't given.
+		clock_offset = clock_locked ? clock_offset + err : reference - local;
+		clock_rate = 0;
+		clock_locked = 1;
+		last_local = last_trim = local;
+		return;
+	}
+
+	int32_t elapsed = local - last_local;
+	last_local = local;
+	if( elapsed <= 0 ) return;
+
+	// Take out half the phase error now, averaging out host/USB jitter.
+	clock_offset += err >> 1;
+
+	// And fold half of the implied rate error into the rate, in 2^-16 ticks
+	// per command tick.
+	int32_t ticks = elapsed / COMMAND_POLL_TICKS;
+	if( ticks < 1 ) ticks = 1;
+	if( err > 32767 ) err = 32767;
+	if( err < -32767 ) err = -32767;
+	clock_rate += ( err << 15 ) / ticks;
+
+	// If we are correcting by more than most of a trim step, fix the HSI
+	// instead.  A faster HSI makes display time run faster.
+	const int32_t step = ( ( COMMAND_POLL_TICKS * TIME_SYNC_TRIM_STEP_PPM /
+		1000 ) << 16 ) / 1000 * 3 / 4;
+	if( (int32_t)( local - last_trim ) > TIME_SYNC_MIN_TRIM_TICKS &&
+		( clock_rate > step || clock_rate < -step ) )
+	{
+		int trim = ( RCC->CTLR & RCC_HSITRIM ) >> 3;
+		trim += ( clock_rate > 0 ) ? 1 : -1;
+		if( trim >= 0 && trim <= 31 )
+		{
+			RCC->CTLR = ( RCC->CTLR & ~RCC_HSITRIM ) | ( trim << 3 );
+			clock_rate += ( clock_rate > 0 ) ? -step * 4 / 3 : step * 4 / 3;
+		}
+		last_trim = local;
+	}
+}
+
+static uint16_t Crc16Byte( uint16_t crc, uint8_t b )
+{
+	// CRC-16/CCITT one nibble at a time, the table is only 32 bytes of flash.
+	static const uint16_t nibble[16] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+		0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef };
+	crc = ( crc << 4 ) ^ nibble[( crc >> 12 ) ^ ( b >> 4 )];
+	crc = ( crc << 4 ) ^ nibble[( crc >> 12 ) ^ ( b & 0xf )];
+	return crc;
+}
+
+// Configuration store.
+//
+// So a tube can come up by itself, without a host, we keep the last command
+// of each sticky kind (HV, display, aux, tuning, parameters) in
+// config_slots, and command 12 writes them to flash.  At boot, ConfigLoad
+// runs them again, right after the timers are set up.
+//
+// The store is the last CONFIG_PAGES 64-byte pages of flash, used as a log
+// of 128-byte records, two pages each: each commit goes into the record
+// after the newest one, so wear is spread over all of them, and if we lose
+// power part way through, the CRC is bad and the previous record still
+// stands.  A record is:
+//   word 0: CONFIG_MAGIC | sequence << 16
+//   words 1..23: config_slots, 0 for none
+//   words 24..30: 0
+//   word 31: CRC-16/CCITT of words 0..30
+#define CONFIG_PAGES 8
+#define CONFIG_PAGE_SIZE 64
+#define CONFIG_RECORD_SIZE 128
+#define CONFIG_RECORDS ( CONFIG_PAGES * CONFIG_PAGE_SIZE / CONFIG_RECORD_SIZE )
+#define CONFIG_BASE ( FLASH_BASE + 16384 - CONFIG_PAGES * CONFIG_PAGE_SIZE )
+#define CONFIG_MAGIC 0xC0F1
+#define CONFIG_SLOTS ( CONFIG_SLOT_GAIN + GAIN_VDD_BANDS * GAIN_HV_BANDS )
+
+#define CONFIG_SLOT_HV 0
+#define CONFIG_SLOT_DISPLAY 1     // Commands 2, 3 and 6.
+#define CONFIG_SLOT_AUX 2         // Commands 5 and 8.
+#define CONFIG_SLOT_TUNING 3
+#define CONFIG_SLOT_PARAM 4       // Command 7, one slot per parameter id,
+#define CONFIG_PARAMS 10          // except 6, which goes in
+#define CONFIG_SLOT_GAIN 14       // one slot per gain schedule entry.
+
+#define CONFIG_COMMIT 1
+#define CONFIG_ERASE 2
+#define CONFIG_WRITE_CAL 3
+
+uint32_t config_slots[CONFIG_SLOTS];
+uint32_t config_display_staged;  // Goes in CONFIG_SLOT_DISPLAY on a latch.
+uint16_t config_sequence;
+uint8_t config_record = CONFIG_RECORDS;  // Newest good one, or CONFIG_RECORDS.
+volatile uint8_t config_request;
+
+static void HandleCommand( uint32_t dmdword, uint32_t ext );
+
+static void ConfigRemember( uint32_t dmdword )
+{
+	int slot;
+	switch( dmdword & 0x0f )
+	{
+	case 1: slot = CONFIG_SLOT_HV; break;
+	case 2: case 3: case 6:
+		// Staged content only counts once it's latched.
+		if( ( dmdword & 0xf0 ) == 0x60 )
+		{
+			config_display_staged = dmdword & ~0xf0;
+			return;
+		}
+		slot = CONFIG_SLOT_DISPLAY;
+		break;
+	case 10:
+		if( display_staged )
+			config_slots[CONFIG_SLOT_DISPLAY] = config_display_staged;
+		return;
+	case 4: slot = CONFIG_SLOT_TUNING; break;
+	case 5: case 8: slot = CONFIG_SLOT_AUX; break;
+	case 7:
+		slot = ( dmdword >> 8 ) & 0xff;
+		if( slot >= CONFIG_PARAMS ) return;
+		if( slot == 6 )
+		{
+			slot = ( dmdword >> 16 ) & 0xf;
+			if( slot >= GAIN_VDD_BANDS * GAIN_HV_BANDS ) return;
+			slot += CONFIG_SLOT_GAIN;
+		}
+		else
+			slot += CONFIG_SLOT_PARAM;
+		break;
+	default: return;
+	}
+	// Store it unstaged, so it shows at boot without a latch.
+	config_slots[slot] = dmdword & ~0xf0;
+}
+
+static uint16_t ConfigCRC( const uint32_t * record )
+{
+	uint16_t crc = 0xffff;
+	const uint8_t * b = (const uint8_t *)record;
+	int i;
+	for( i = 0; i < CONFIG_RECORD_SIZE - 4; i++ )
+		crc = Crc16Byte( crc, b[i] );
+	return crc;
+}
+
+static const uint32_t * ConfigPage( int page )
+{
+	return (const uint32_t *)( CONFIG_BASE + page * CONFIG_PAGE_SIZE );
+}
+
+static const uint32_t * ConfigRecord( int n )
+{
+	return (const uint32_t *)( CONFIG_BASE + n * CONFIG_RECORD_SIZE );
+}
+
+static void ConfigFind()
+{
+	int n;
+	config_record = CONFIG_RECORDS;
+	for( n = 0; n < CONFIG_RECORDS; n++ )
+	{
+		const uint32_t * record = ConfigRecord( n );
+		uint16_t sequence = record[0] >> 16;
+		if( ( record[0] & 0xffff ) != CONFIG_MAGIC ||
+			( record[CONFIG_RECORD_SIZE / 4 - 1] & 0xffff ) !=
+				ConfigCRC( record ) )
+			continue;
+		if( config_record == CONFIG_RECORDS ||
+			(int16_t)( sequence - config_sequence ) > 0 )
+		{
+			config_record = n;
+			config_sequence = sequence;
+		}
+	}
+}
+
+static void ConfigLoad()
+{
+	ConfigFind();
+	if( config_record == CONFIG_RECORDS ) return;
+
+	// The display commands use cathode_budget as they run, so run the
+	// tuning, parameter and gain slots first, then HV, display and aux.
+	const uint32_t * record = ConfigRecord( config_record );
+	int i;
+	for( i = 0; i < CONFIG_SLOTS; i++ )
+	{
+		int slot = ( i + CONFIG_SLOT_TUNING ) % CONFIG_SLOTS;
+		if( record[slot+1] )
+			HandleCommand( record[slot+1], 0 );
+	}
+}
+
+static void ConfigFlashWait()
+{
+	while( FLASH->STATR & FLASH_FLAG_BSY );
+}
+
+static void ConfigFlashBegin()
+{
+	// While the flash is busy, anything running from flash stalls, including
+	// (maybe) the ADC interrupt, so don't leave the FET running open loop.
+	NVIC_DisableIRQ( ADC_IRQn );
+	TIM1->CH2CVR = 0;
+
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	FLASH->MODEKEYR = FLASH_KEY1;
+	FLASH->MODEKEYR = FLASH_KEY2;
+}
+
+static void ConfigFlashEnd()
+{
+	FLASH->CTLR = CR_LOCK_Set;
+	NVIC_EnableIRQ( ADC_IRQn );
+}
+
+static void ConfigErasePage( int page )
+{
+	FLASH->CTLR = CR_PAGE_ER;
+	FLASH->ADDR = (uint32_t)ConfigPage( page );
+	FLASH->CTLR = CR_PAGE_ER | CR_STRT_Set;
+	ConfigFlashWait();
+	FLASH->CTLR = 0;
+	WatchdogPet();
+}
+
+static void ConfigWritePage( int page, const uint32_t * record )
+{
+	volatile uint32_t * dest = (volatile uint32_t *)ConfigPage( page );
+	int i;
+
+	ConfigErasePage( page );
+
+	// Fast page programming: fill the 64-byte buffer, then write it at once.
+	FLASH->CTLR = CR_PAGE_PG;
+	FLASH->CTLR = CR_PAGE_PG | CR_BUF_RST;
+	ConfigFlashWait();
+	for( i = 0; i < CONFIG_PAGE_SIZE / 4; i++ )
+	{
+		dest[i] = record[i];
+		FLASH->CTLR = CR_PAGE_PG | CR_BUF_LOAD;
+		ConfigFlashWait();
+	}
+	FLASH->ADDR = (uint32_t)dest;
+	FLASH->CTLR = CR_PAGE_PG | CR_STRT_Set;
+	ConfigFlashWait();
+	FLASH->CTLR = 0;
+	WatchdogPet();
+}
+
+// Per-unit HV calibration.
+//
+// The "divide by 120" above assumes a VREF of exactly 1.2V and a divider of
+// exactly 1M/10k.  Neither is, so each unit has two trims, each the error in
+// 1/1024ths (so +/-12%), stored in the option bytes' user data, Data0 for
+// VREF and Data1 for the divider.  They're folded into target_scaled when
+// the target changes, so the ADC interrupt only has its fraction to dither.
+//
+// To calibrate against a meter (command 13, byte 1 is the step):
+//   ./minichlink -s 0x04 0x0000044d # Forget the trims.
+//   Measure VDD, e.g. 4.98V:
+//   ./minichlink -s 0x04 0x1374014d # VDD is 4980mV, sets the VREF trim.
+//   ./minichlink -s 0x04 0x00960041 # 150V, measure the HV, e.g. 147.3V:
+//   ./minichlink -s 0x04 0x05c1024d # HV is 1473 (0.1V), sets divider trim.
+//   ./minichlink -s 0x04 0x0000034d # Write both to the option bytes.
+//   ./minichlink -s 0x04 0x0000004d # Read them back (from DMDATA1).
+int8_t cal_vref;
+int8_t cal_divider;
+
+static void ApplyCalibration()
+{
+	// target * 1 / ( ( 1 + vref ) * ( 1 + divider ) ), scale in Q10, kept
+	// to TARGET_FRAC bits, rounded.  Slow path, the divide is fine.
+	uint32_t scale = ( 1u << 30 ) /
+		( ( 1024 + cal_vref ) * ( 1024 + cal_divider ) );
+	target_scaled = ( FixMul( target_feedback, scale ) +
+		( 1 << ( 9 - TARGET_FRAC ) ) ) >> ( 10 - TARGET_FRAC );
+}
+
+static int CalibrationByte( uint16_t ob )
+{
+	// The top byte of each option byte is the complement of the bottom.
+	// If it isn't, it was never written, so no trim.
+	return ( ( ( ob >> 8 ) ^ ob ) & 0xff ) == 0xff ? (int8_t)ob : 0;
+}
+
+static void LoadCalibration()
+{
+	cal_vref = CalibrationByte( OB->Data0 );
+	cal_divider = CalibrationByte( OB->Data1 );
+	ApplyCalibration();
+}
+
+static int ClampTrim( int trim )
+{
+	return ( trim > 127 ) ? 127 : ( trim < -127 ) ? -127 : trim;
+}
+
+static void CalibrationWrite()
+{
+	// Option bytes can only be erased all together, so keep the others.
+	// We only write the bottom byte, the flash controller adds the
+	// complement.
+	uint8_t rdpr = OB->RDPR;
+	uint8_t user = OB->USER;
+	uint8_t wrpr0 = OB->WRPR0;
+	uint8_t wrpr1 = OB->WRPR1;
+
+	FLASH->OBKEYR = FLASH_KEY1;
+	FLASH->OBKEYR = FLASH_KEY2;
+
+	FLASH->CTLR = CR_OPTER_Set;
+	FLASH->CTLR = CR_OPTER_Set | CR_STRT_Set;
+	ConfigFlashWait();
+	WatchdogPet();
+
+	FLASH->CTLR = CR_OPTPG_Set;
+	OB->RDPR = rdpr;
+	ConfigFlashWait();
+	OB->USER = user;
+	ConfigFlashWait();
+	OB->Data0 = (uint8_t)cal_vref;
+	ConfigFlashWait();
+	OB->Data1 = (uint8_t)cal_divider;
+	ConfigFlashWait();
+	OB->WRPR0 = wrpr0;
+	ConfigFlashWait();
+	OB->WRPR1 = wrpr1;
+	ConfigFlashWait();
+	FLASH->CTLR = 0;
+}
+
+static void TaskConfig()
+{
+	int request = config_request;
+	if( !request ) return;
+	config_request = 0;
+
+	ConfigFlashBegin();
+	if( request == CONFIG_WRITE_CAL )
+	{
+		CalibrationWrite();
+	}
+	else if( request == CONFIG_ERASE )
+	{
+		int page;
+		for( page = 0; page < CONFIG_PAGES; page++ )
+			ConfigErasePage( page );
+	}
+	else
+	{
+		uint32_t record[CONFIG_RECORD_SIZE / 4] = { 0 };
+		int i;
+		int n = ( config_record + 1 ) % CONFIG_RECORDS;
+		record[0] = CONFIG_MAGIC | (uint32_t)( config_sequence + 1 ) << 16;
+		for( i = 0; i < CONFIG_SLOTS; i++ )
+			record[i+1] = config_slots[i];
+		record[CONFIG_RECORD_SIZE / 4 - 1] =
+			ConfigCRC( record ) | 0xffff0000;
+		// Both pages, the CRC is in the second so it goes in last.
+		for( i = 0; i < CONFIG_RECORD_SIZE / CONFIG_PAGE_SIZE; i++ )
+			ConfigWritePage( n * CONFIG_RECORD_SIZE / CONFIG_PAGE_SIZE + i,
+				record + i * CONFIG_PAGE_SIZE / 4 );
+	}
+	ConfigFlashEnd();
+
+	// Read back what's actually there now.
+	ConfigFind();
+}
+
+static void HandleCommand( uint32_t dmdword, uint32_t ext )
 {
 	// You can use minichlink to setup this:
 	// ./minichlink -s 0x04 0x00B40041 # Configure for 180V.
 	// ./minichlink -s 0x04 0x00030042 # Light digit "8"
 	// ./minichlink -s 0x04 0x60303243 # Dimly light 8 and 8.
+	// ./minichlink -s 0x04 0x001bc346 # Digit "8" with a dim dot.
+	// ./minichlink -s 0x04 0x00c00047 # Cathode budget to 192/256.
+	// ./minichlink -s 0x04 0x00ff4148 # Aux neon breathing, ~0.7s.
 	// ./minichlink -g 0x04            # Get status.
+	// ./minichlink -g 0x05            # Get the reply of the last command.
+	// ./minichlink -s 0x04 0x00000149 # Query command latency percentiles.
+	// ./minichlink -s 0x04 0x00030062 # Stage digit "8" ...
+	// ./minichlink -s 0x04 0x0000004a # ... and show it.
 
 	// Note: To get here, DEBUG0's LSB must be 0x4x command is that 'x'
+	// (or it came in over the sequenced protocol, see PollDebugMailbox).
+	// ext is the extra 24 bits of payload the sequenced protocol carries.
 	int command = dmdword & 0x0f;
+	int staged = ( dmdword & 0xf0 ) == 0x60;
+	command_reply = 0;
+
+	ConfigRemember( dmdword );
 
 	switch( command )
 	{
@@ -443,26 +1780,53 @@ static void HandleCommand( uint32_t dmdword )
 		int feedback = dmdword >> 16;
 		if( feedback > ABSOLUTE_MAX_ADC_SET )
 			feedback = ABSOLUTE_MAX_ADC_SET;
+#ifdef ENABLE_LOAD_FEEDFORWARD
+		// What we learned only holds for the voltage we learned it at.
+		if( feedback != target_feedback )
+		{
+			int i;
+			for( i = 0; i < sizeof( load_ff_learned ) / 4; i++ )
+				load_ff_learned[i] = 0;
+		}
+#endif
+		int changed = feedback != target_feedback;
 		target_feedback = feedback;
+		ApplyCalibration();
+		// Have the ADC interrupt preload the integral for the new target.
+		if( changed )
+			setpoint_update = 1;
 		break;
 	}
 	case 2:
 	{
 		int segmenton = (dmdword>>16)&0x0f;
-
-		fade_time0 = -1;
-		fade_time1 = -1;
-		fade_disp0 = GenOnMask(segmenton);
-		fade_disp1 = 0;
+		struct DisplayState * ds = staged ? &display_staging : display_back;
+
+		ds->fade_time[0] = cathode_budget;
+		ds->fade_time[1] = 0;
+		ds->fade_time[2] = 0;
+		ds->fade_disp[0] = GenOnMask(segmenton);
+		ds->fade_disp[1] = 0;
+		ds->fade_disp[2] = 0;
+		CommitDisplayState( ds, segmenton, staged );
 		break;
 	}
 	case 3:
 	{
 		// Configure a fade.
-		fade_disp0 = GenOnMask( ( dmdword >> 8 ) & 0xf );
-		fade_disp1 = GenOnMask( ( dmdword >> 12 ) & 0xf );
-		fade_time0 = ( dmdword >> 16 ) & 0xff;
-		fade_time1 = ( dmdword >> 24 ) & 0xff;
+		struct DisplayState * ds = staged ? &display_staging : display_back;
+		int time0 = ( dmdword >> 16 ) & 0xff;
+		int time1 = ( dmdword >> 24 ) & 0xff;
+		if( time0 > cathode_budget ) time0 = cathode_budget;
+		if( time1 > cathode_budget ) time1 = cathode_budget;
+
+		ds->fade_disp[0] = GenOnMask( ( dmdword >> 8 ) & 0xf );
+		ds->fade_disp[1] = GenOnMask( ( dmdword >> 12 ) & 0xf );
+		ds->fade_disp[2] = 0;
+		ds->fade_time[0] = time0;
+		ds->fade_time[1] = time1;
+		ds->fade_time[2] = 0;
+		CommitDisplayState( ds, ( dmdword >> 8 ) & 0xf, staged );
 		break;
 	}
 	case 4:
@@ -485,13 +1849,566 @@ static void HandleCommand( uint32_t dmdword )
 	case 5:
 	{
 		// Aux Neon Control
-		TIM2->CH4CVR = dmdword>>16;
+		SetAuxEffect( AUX_EFFECT_STATIC, 0, dmdword>>16, 0 );
+		break;
+	}
+	case 6:
+	{
+		// Composite frame.  Up to 3 cathodes share a frame, each nibble pair
+		// is segment, then weight. They get slices of the cathode budget in
+		// proportion to their weights.  This is not in a hot path, so we can
+		// afford a divide here.
+		struct DisplayState * ds = staged ? &display_staging : display_back;
+		uint32_t weights = 0;
+		int i;
+		for( i = 0; i < DISPLAY_ENTRIES; i++ )
+			weights += ( dmdword >> ( 12 + i * 8 ) ) & 0xf;
+
+		uint32_t cumulative = 0;
+		for( i = 0; i < DISPLAY_ENTRIES; i++ )
+		{
+			int segmenton = ( dmdword >> ( 8 + i * 8 ) ) & 0xf;
+			cumulative += ( dmdword >> ( 12 + i * 8 ) ) & 0xf;
+			ds->fade_disp[i] = GenOnMask( segmenton );
+			ds->fade_time[i] = weights ?
+				FixMul( cathode_budget, cumulative ) / weights : 0;
+		}
+		CommitDisplayState( ds, ( dmdword >> 8 ) & 0xf, staged );
+		break;
+	}
+	case 7:
+	{
+		// Set a parameter. Byte 1 selects which, the top 16 bits are value.
+		int value = dmdword >> 16;
+		switch( ( dmdword >> 8 ) & 0xff )
+		{
+		case 0:
+			cathode_budget = ( value > 256 ) ? 256 : value;
+			break;
+#ifdef ENABLE_UART_TRANSPORT
+		case 1:
+			uart_address = value & 0x7f;
+			break;
+#endif
+		case 2:
+			// Standby after this many ms of blank display, 0 for never.
+			standby_ticks = value * 6000;
+			break;
+		case 4:
+			// Adaptive IIR threshold in ADC counts, 0 for the fixed IIR.
+			adaptive_adc = value << ADC_IIR;
+			adaptive_vdd = value << VDD_IIR;
+			break;
+		case 5:
+			// Oversample 4^value conversions per control update.
+			if( value > ADC_FRAC ) value = ADC_FRAC;
+			oversample_count = 1 << ( value * 2 );
+			oversample_log4 = value;
+			break;
+		case 6:
+		{
+			// Gain schedule entry: [3:0] entry, then the P, I and D shifts.
+			// The config store keeps each entry in its own slot.
+			int entry = value & 0xf;
+			int i = ( value >> 8 ) & 0xf;
+			if( entry >= GAIN_VDD_BANDS * GAIN_HV_BANDS ) break;
+			// The load feedforward is shifted left by i - LOAD_FF_FRAC.
+			if( i < GAIN_I_MIN ) i = GAIN_I_MIN;
+			gain_schedule[entry].p = ( value >> 4 ) & 0xf;
+			gain_schedule[entry].i = i;
+			gain_schedule[entry].d = ( value >> 12 ) & 0xf;
+			if( entry == gain_next ) gain_update = 1;
+			break;
+		}
+#ifdef ENABLE_FAST_ADC_IRQ
+		case 3:
+			// ADC interrupt entry, 0 = vector table, 1 = VTF.
+			SetFastAdcPath( value );
+			break;
+#endif
+#ifdef ENABLE_HV_OBSERVER
+		case 7:
+			// HV observer: 0 for the PID to use the filtered ADC, else the
+			// observer's estimate, with a correction of 2^-value.
+			obs_on = value != 0;
+			obs_l = value ? ( value > 15 ? 15 : value ) : OBS_L_DEFAULT;
+			break;
+		case 8:
+			obs_a = value;
+			break;
+		case 9:
+			obs_b = value;
+			break;
+#endif
+		}
+		break;
+	}
+	case 8:
+	{
+		// Aux neon effect: effect, rate, level, param.
+		SetAuxEffect( ( dmdword >> 8 ) & 0xf, ( dmdword >> 12 ) & 0xf,
+			( dmdword >> 16 ) & 0xff, dmdword >> 24 );
+		break;
+	}
+	case 9:
+	{
+		// Query. Byte 1 selects what, the answer goes in command_reply.
+		switch( ( dmdword >> 8 ) & 0xff )
+		{
+		case 0:
+			command_reply = (uint32_t)&command_ring;
+			break;
+		case 12:
+			// Where the pipelined protocol's command slots are.
+			command_reply = (uint32_t)&command_slots;
+			command_slot_restart = 1;
+			break;
+		case 1:
+			command_reply = LatencyPercentiles();
+			break;
+		case 3:
+			command_reply = clock_offset;
+			break;
+		case 4:
+			command_reply = ( clock_rate & 0xffffff ) |
+				( ( RCC->CTLR & RCC_HSITRIM ) << 21 );
+			break;
+		case 5: case 6: case 7:
+			// Time spent running, idle and in HV standby, in 256 tick
+			// (~43us) units.
+			command_reply = power_ticks[( ( dmdword >> 8 ) & 0xff ) - 5] >> 8;
+			break;
+		case 8:
+		{
+			// Task statistics, bits 16+ pick the task.  Max runtime in
+			// SysTick ticks, then the number of overruns.
+			uint32_t task = dmdword >> 16;
+			if( task < NUM_TASKS )
+				command_reply = tasks[task].runtime_max |
+					( tasks[task].overruns << 16 );
+			break;
+		}
+#ifdef ENABLE_FAST_ADC_IRQ
+		case 9:
+			// ADC entry timing in 1/16 cycles, VTF in the low 16 bits, vector
+			// table in the top.  top - bottom is the cycles saved per entry.
+			command_reply = adc_entry_phase[1] | ( adc_entry_phase[0] << 16 );
+			break;
+#endif
+		case 10:
+			// HV and VDD with ADC_FRAC fractional bits (12 bits), HV in the
+			// low 16.
+			command_reply = ( lastadc >> ( ADC_IIR - ADC_FRAC ) ) |
+				( ( lastrefvdd >> ( VDD_IIR - ADC_FRAC ) ) << 16 );
+			break;
+#ifdef ENABLE_HV_OBSERVER
+		case 11:
+			// Observer identification: the last duty in the low 16, the
+			// average innovation (signed, lastadc units << OBS_FRAC) on top.
+			command_reply = obs_duty | ( (uint32_t)obs_residual << 16 );
+			break;
+#endif
+#ifdef ENABLE_FIXMATH_BENCH
+		case 13:
+			// Cycles per call, bits 16+ pick the function, see FixMathBench.
+			command_reply = FixMathBench( dmdword >> 16 );
+			break;
+#endif
+		case 2:
+		{
+			// Clear the latency statistics.
+			int i;
+			for( i = 0; i < LATENCY_BUCKETS; i++ )
+				latency_histogram[i] = 0;
+			latency_max = 0;
+			break;
+		}
+		}
+		break;
+	}
+	case 11:
+	{
+		// Time sync.  The top 24 bits (and with the sequenced protocol, the
+		// bottom 8 of ext on top of that) are the host's time, in ticks.
+		// No ext means only 24 bits; so does ext == 0, but then the host's
+		// time fits in 24 bits and that comes out the same.
+		TimeSync( ( dmdword >> 8 ) | ( ext << 24 ), ext ? 32 : 24 );
+		break;
+	}
+	case 10:
+	{
+		// Latch whatever was staged.  Byte 1, bits 0..3 are the mode, and the
+		// top 20 bits are the time for LATCH_AT_TIME.
+		Latch( ( dmdword >> 8 ) & 0xf, dmdword >> 12 );
+		break;
+	}
+	case 12:
+	{
+		// Configuration store.  Byte 1 is CONFIG_COMMIT to save the current
+		// setup as what we boot into, or CONFIG_ERASE to boot blank.  The
+		// write happens in TaskConfig.  Replies with the sequence number of
+		// the newest record, and 1<<16 if there is one.
+		int request = ( dmdword >> 8 ) & 0xff;
+		if( request == CONFIG_COMMIT || request == CONFIG_ERASE )
+			config_request = request;
+		command_reply = config_sequence |
+			( ( config_record != CONFIG_RECORDS ) << 16 );
+		break;
+	}
+	case 13:
+	{
+		// HV calibration, see ApplyCalibration.  Byte 1 is the step, the top
+		// 16 bits the reading.  Replies with the trims, VREF in byte 0 and
+		// the divider in byte 1.
+		uint32_t value = dmdword >> 16;
+		switch( ( dmdword >> 8 ) & 0xff )
+		{
+		case 1:
+		{
+			// value is VDD in mV.  VREF = VDD * refvdd / 1023, and we want
+			// VREF / 1.2V - 1, in 1/1024ths, so the ratio is
+			// VDD * refvdd * 1024 / ( 1023 * 1200 ), or * 64 / ( 1023 * 75 ).
+			// For example at 5000mV, a 1.2V VREF reads 246 (984 filtered):
+			//   5000 * 984 * 64 / ( 1023 * 75 * 4 ) = 1026, a trim of +2.
+			uint32_t ratio = ( value * lastrefvdd * 64 ) /
+				( ( 1023 * 75 ) << VDD_IIR );
+			cal_vref = ClampTrim( (int)ratio - 1024 );
+			break;
+		}
+		case 2:
+			// value is the HV in 0.1V, with the current target and trims.
+			// It comes out as far off as the divider is.
+			if( target_feedback )
+				cal_divider = ClampTrim( (int)( ( 1024 + cal_divider ) *
+					value / ( target_feedback * 10 ) ) - 1024 );
+			break;
+		case 3:
+			config_request = CONFIG_WRITE_CAL;
+			break;
+		case 4:
+			cal_vref = 0;
+			cal_divider = 0;
+			break;
+		}
+		ApplyCalibration();
+		command_reply = (uint8_t)cal_vref | ( (uint8_t)cal_divider << 8 );
+		break;
+	}
+
+	}
+}
+
+static uint32_t StatusWord()
+{
+	// Status is our VDD and our FB V.  The bottom 12 bits are left clear.
+	return ((lastadc>>ADC_IIR) << 12) | ((lastrefvdd>>VDD_IIR) << 22);
+}
+
+static int PollDebugMailbox()
+{
+	// There are two ways of talking to us over the debug interface.
+	//
+	// Legacy: The host writes a command word to DMDATA0 with 0x4x in the
+	// LSB (or 0x6x for the staged version), we run it, put command_reply in
+	// DMDATA1, and overwrite DMDATA0 with the status word.
+	//
+	// Sequenced: The host first writes the low 32 bits of a 56-bit payload
+	// to DMDATA1, which is a normal command word, then writes DMDATA0 with:
+	//   [31:8] the other 24 bits of payload, [7:4] 0x5, [3:0] sequence.
+	// We run it, put command_reply in DMDATA1, then write DMDATA0 with:
+	//   [31:12] status word, [7:4] 0x2 (ack) or 0x3, [3:0] sequence.
+	// 0x3 means the sequence number was not the one after the last one we
+	// saw, so the host knows a command got lost and what to resend.  DMDATA1
+	// carries both the command and the reply, so the host has to wait for
+	// the ack before it writes the next command.
+	//
+	// Pipelined: The host writes each command (word, then the other 24 bits
+	// of payload in ext) into command_slots, at its sequence number, then
+	// rings the doorbell, writing DMDATA0 with:
+	//   [7:4] 0x7, [3:0] the sequence number of the newest slot written.
+	// We run every slot after the last one we ran, up to that one, in
+	// order, leave each reply in its slot, then write DMDATA0 with:
+	//   [31:12] status word, [7:4] 0x2, [3:0] the last sequence number run.
+	// The doorbell is cumulative, so the host can keep writing slots and
+	// ringing it without waiting, as long as it stays less than
+	// COMMAND_SLOTS ahead of the last ack.  If our ack lands on top of a
+	// newer doorbell, the ack shows an older sequence than the host's
+	// newest, and the host just rings again; that runs nothing twice.
+	// After query 12, by any path, the host has to start again from
+	// sequence 0: the slots it sent with the old numbering still run, up to
+	// the doorbell, but the next doorbell starts from slot 0.
+	uint32_t dmdword = *DMDATA0;
+	uint32_t marker = dmdword & 0xf0;
+	if( marker == 0x40 || marker == 0x60 )
+	{
+		// I think there is a compiler bug here.  For some reason if I put
+		// the code in this function right here, it doesn't work right.
+		// so I encapsulated the code in a function.
+		//
+		// This function handles commands we get over the programming
+		// interface.  Like "set HV bus" or "set this digit on."
+		HandleCommand( dmdword, 0 );
+
+		// Write the status back to the host PC.
+		*DMDATA1 = command_reply;
+		*DMDATA0 = StatusWord();
+		return 1;
 	}
+	else if( marker == 0x50 )
+	{
+		static uint32_t lastseq = 0xf;
+		uint32_t seq = dmdword & 0x0f;
+		uint32_t ack = ( seq == ( ( lastseq + 1 ) & 0x0f ) ) ? 0x20 : 0x30;
+		lastseq = seq;
 
+		HandleCommand( *DMDATA1, dmdword >> 8 );
+
+		*DMDATA1 = command_reply;
+		*DMDATA0 = StatusWord() | ack | seq;
+		return 1;
 	}
+	else if( marker == 0x70 )
+	{
+		uint32_t newest = dmdword & 0x0f;
+		if( command_slot_restart )
+		{
+			command_slot_seq = 0xf;
+			command_slot_restart = 0;
+		}
+		while( command_slot_seq != newest )
+		{
+			command_slot_seq = ( command_slot_seq + 1 ) & 0x0f;
+			struct CommandSlot * cs =
+				&command_slots.slot[command_slot_seq & ( COMMAND_SLOTS - 1 )];
+			HandleCommand( cs->word, cs->ext );
+			cs->reply = command_reply;
+		}
+		*DMDATA0 = StatusWord() | 0x20 | command_slot_seq;
+		return 1;
+	}
+	return 0;
+}
 
-	// Write the status back to the host PC.  Status is our VDD and our FB V
-	*DMDATA0 = ((lastadc>>ADC_IIR) << 12) | ((lastrefvdd>>VDD_IIR) << 22);
+static int DrainCommandRing()
+{
+	// Run what the host left in the command ring, but not so much at once
+	// that we hog the CPU.
+	uint32_t tail = command_ring.tail;
+	int burst = COMMAND_RING_BURST;
+	while( tail != ( command_ring.head & ( COMMAND_RING_SIZE - 1 ) ) && burst )
+	{
+		HandleCommand( command_ring.commands[tail], 0 );
+		tail = ( tail + 1 ) & ( COMMAND_RING_SIZE - 1 );
+		command_ring.tail = tail;
+		burst--;
+	}
+	return COMMAND_RING_BURST - burst;
+}
+
+#ifdef ENABLE_UART_TRANSPORT
+
+// UART transport.
+//
+// Optionally, we can also take commands over USART1, in single-wire half-
+// duplex mode on PD5 (open drain, so put a pull-up on the bus), so one host
+// UART can drive a whole bus of tubes.  Both directions use DMA, RX into a
+// circular buffer that the SysTick interrupt parses.
+//
+// Frames are:
+//   0xA5, address, length, payload (length bytes), CRC16 (LSB first)
+// The payload is a list of command words, LSB first, just like the command
+// ring.  The CRC is CRC-16/CCITT-FALSE over address, length and payload.
+// Address UART_BROADCAST goes to everyone, and gets no reply. If the frame
+// was addressed to us, we reply with a frame with our address | 0x80,
+// carrying the status word and the last command_reply.  Frames with 0x80
+// set in the address are replies, so we ignore those (including our own
+// echo, which we hear because the bus is half-duplex).
+#define UART_BAUD 1000000
+#define UART_SYNC 0xA5
+#define UART_BROADCAST 0x7F
+#define UART_RX_SIZE 64  // Must be a power of 2.
+#define UART_MAX_PAYLOAD 32
+
+uint8_t * uart_rx;  // From the arena, UART_RX_SIZE long.
+uint8_t uart_tx[13];
+
+struct UartParser
+{
+	uint8_t state;
+	uint8_t address;
+	uint8_t length;
+	uint8_t place;
+	uint16_t crc;
+	uint16_t rxcrc;
+	uint32_t tail;
+	uint8_t payload[UART_MAX_PAYLOAD];
+} uart_parser;
+
+#define UART_STATE_SYNC 0
+#define UART_STATE_ADDRESS 1
+#define UART_STATE_LENGTH 2
+#define UART_STATE_PAYLOAD 3
+#define UART_STATE_CRC0 4
+#define UART_STATE_CRC1 5
+
+static void SetupUart()
+{
+	RCC->APB2PCENR |= RCC_APB2Periph_USART1;
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+
+	// PD5 is USART1 TX, which is the only pin in half-duplex mode.
+	GPIOD->CFGLR = ( GPIOD->CFGLR & ~(0xf<<(4*5)) ) |
+		(GPIO_Speed_10MHz | GPIO_CNF_OUT_OD_AF)<<(4*5);
+
+	USART1->BRR = SYSTEM_CORE_CLOCK / UART_BAUD;
+	USART1->CTLR3 = USART_CTLR3_HDSEL | USART_CTLR3_DMAR | USART_CTLR3_DMAT;
+	USART1->CTLR1 = USART_CTLR1_TE | USART_CTLR1_RE | USART_CTLR1_UE;
+
+	// RX: DMA1 Channel 5, circular, forever.
+	DMA1_Channel5->PADDR = (uint32_t)&USART1->DATAR;
+	DMA1_Channel5->MADDR = (uint32_t)uart_rx;
+	DMA1_Channel5->CNTR = UART_RX_SIZE;
+	DMA1_Channel5->CFGR = DMA_M2M_Disable | DMA_Priority_High |
+		DMA_MemoryDataSize_Byte | DMA_PeripheralDataSize_Byte |
+		DMA_MemoryInc_Enable | DMA_Mode_Circular | DMA_DIR_PeripheralSRC |
+		DMA_CFGR1_EN;
+
+	// TX: DMA1 Channel 4, kicked off per reply.
+	DMA1_Channel4->PADDR = (uint32_t)&USART1->DATAR;
+	DMA1_Channel4->MADDR = (uint32_t)uart_tx;
+}
+
+static void UartReply()
+{
+	// Don't stomp on a reply still going out.
+	if( DMA1_Channel4->CNTR ) return;
+
+	uint32_t status = StatusWord();
+	uint16_t crc = 0xffff;
+	int i;
+
+	uart_tx[0] = UART_SYNC;
+	uart_tx[1] = uart_address | 0x80;
+	uart_tx[2] = 8;
+	for( i = 0; i < 4; i++ )
+	{
+		uart_tx[3+i] = status >> ( i * 8 );
+		uart_tx[7+i] = command_reply >> ( i * 8 );
+	}
+	for( i = 1; i < 11; i++ )
+		crc = Crc16Byte( crc, uart_tx[i] );
+	uart_tx[11] = crc;
+	uart_tx[12] = crc >> 8;
+
+	DMA1_Channel4->CFGR = 0;
+	DMA1_Channel4->CNTR = sizeof( uart_tx );
+	DMA1_Channel4->CFGR = DMA_M2M_Disable | DMA_Priority_High |
+		DMA_MemoryDataSize_Byte | DMA_PeripheralDataSize_Byte |
+		DMA_MemoryInc_Enable | DMA_Mode_Normal | DMA_DIR_PeripheralDST |
+		DMA_CFGR1_EN;
+}
+
+static int PollUart()
+{
+	struct UartParser * up = &uart_parser;
+	uint32_t head = ( UART_RX_SIZE - DMA1_Channel5->CNTR ) & ( UART_RX_SIZE - 1 );
+	uint32_t tail = up->tail;
+	int handled = 0;
+
+	while( tail != head )
+	{
+		uint8_t b = uart_rx[tail];
+		tail = ( tail + 1 ) & ( UART_RX_SIZE - 1 );
+
+		switch( up->state )
+		{
+		case UART_STATE_SYNC:
+			if( b == UART_SYNC )
+			{
+				up->crc = 0xffff;
+				up->state = UART_STATE_ADDRESS;
+			}
+			break;
+		case UART_STATE_ADDRESS:
+			up->address = b;
+			up->crc = Crc16Byte( up->crc, b );
+			up->state = UART_STATE_LENGTH;
+			break;
+		case UART_STATE_LENGTH:
+			up->length = b;
+			up->place = 0;
+			up->crc = Crc16Byte( up->crc, b );
+			if( b > UART_MAX_PAYLOAD || ( b & 3 ) )
+				up->state = UART_STATE_SYNC;
+			else
+				up->state = b ? UART_STATE_PAYLOAD : UART_STATE_CRC0;
+			break;
+		case UART_STATE_PAYLOAD:
+			up->payload[up->place++] = b;
+			up->crc = Crc16Byte( up->crc, b );
+			if( up->place == up->length )
+				up->state = UART_STATE_CRC0;
+			break;
+		case UART_STATE_CRC0:
+			up->rxcrc = b;
+			up->state = UART_STATE_CRC1;
+			break;
+		case UART_STATE_CRC1:
+		{
+			up->state = UART_STATE_SYNC;
+			up->rxcrc |= b << 8;
+			if( up->rxcrc != up->crc ) break;
+			if( up->address != uart_address && up->address != UART_BROADCAST )
+				break;
+
+			int i;
+			for( i = 0; i < up->length; i += 4 )
+			{
+				uint8_t * p = &up->payload[i];
+				HandleCommand( p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24), 0 );
+				handled++;
+			}
+
+			if( up->address == uart_address )
+				UartReply();
+			break;
+		}
+		}
+	}
+	up->tail = tail;
+	return handled;
+}
+
+#endif
+
+void SysTick_Handler(void) __attribute__((interrupt)) RAMPLACE( SysTick_Handler );
+void SysTick_Handler(void)
+{
+	static uint32_t lastpoll;
+	uint32_t now = SysTick->CNT;
+
+	// SysTick free-runs (fadepos comes from it), so we move the compare
+	// along.  If we were held up for over a period, don't wait for a wrap.
+	uint32_t next = SysTick->CMP + COMMAND_POLL_TICKS;
+	if( (int32_t)( next - now ) <= 0 )
+		next = now + COMMAND_POLL_TICKS;
+	SysTick->CMP = next;
+	SysTick->SR = 0;
+
+	// Apply the fine rate correction from time sync.
+	clock_rate_frac += clock_rate;
+	clock_offset += (int32_t)clock_rate_frac >> 16;
+	clock_rate_frac &= 0xffff;
+
+	ReleaseTasks( now );
+
+	int handled = PollDebugMailbox() + DrainCommandRing();
+#ifdef ENABLE_UART_TRANSPORT
+	handled += PollUart();
+#endif
+	if( handled && lastpoll )
+		RecordLatency( SysTick->CNT - lastpoll );
+	lastpoll = now;
 }
 
 static inline void WatchdogPet()
@@ -514,9 +2431,49 @@ static inline void WatchdogSetup()
 static inline void AdvanceFadePlace()
 {
 	static uint32_t lastmask = 0;
+	static uint32_t lastframe = 0;
 
 	// Causes us to cycle through all 256 sequence points every 1.5ms.
-	uint32_t fadepos = (SysTick->CNT >> 5) & 0xff;
+	// This runs on display time, so it lines up with the other tubes.
+	uint32_t systick = SysTick->CNT + clock_offset;
+	uint32_t fadepos = (systick >> 5) & 0xff;
+
+	// Only flip to a newly written display state once fadepos wraps. That
+	// way we never render half of one state and half of another. We copy
+	// the new front back, so the next command starts from what is shown.
+	//
+	// Latched updates are the exception, those flip right away, from
+	// display_staging.
+	uint32_t frame = systick >> 13;
+	if( latch_time_armed && ( ( ( systick >> 8 ) - latch_time ) & 0x80000 ) == 0 )
+	{
+		latch_time_armed = 0;
+		display_commit = DISPLAY_COMMIT_NOW;
+	}
+	if( frame != lastframe || display_commit == DISPLAY_COMMIT_NOW )
+	{
+		lastframe = frame;
+		if( display_commit )
+		{
+			// Commands run in the SysTick interrupt, so keep them out of the
+			// back buffer while we swap and copy.
+			NVIC_DisableIRQ( SysTicK_IRQn );
+			if( display_commit == DISPLAY_COMMIT_NOW )
+				*display_back = display_staging;
+			struct DisplayState * ds = display_back;
+			display_back = display_front;
+			display_front = ds;
+			*display_back = *ds;
+			display_commit = 0;
+			display_lit = ds->lit_slots;
+			display_static = ds->is_static;
+			if( ds->lit_slots ) SetHVStandby( 0 );
+#ifdef ENABLE_LOAD_FEEDFORWARD
+			load_ff_key = ds->ff_key;
+#endif
+			NVIC_EnableIRQ( SysTicK_IRQn );
+		}
+	}
 
 	// We want to glow the LEDs with a chopping period of less, so we
 	// "rotate" the bits.  This has the effect of making the primary
@@ -541,6 +2498,142 @@ static inline void AdvanceFadePlace()
 	}
 }
 
+static void AccountPowerState( int state )
+{
+	static uint32_t last;
+	uint32_t now = SysTick->CNT;
+	power_ticks[power_state] += now - last;
+	last = now;
+	power_state = state;
+}
+
+static void SetHVStandby( int standby )
+{
+	if( hv_standby == standby ) return;
+	hv_standby = standby;
+
+	// Changing the prescaler only takes at an update, so force one.
+	TIM1->PSC = standby ? HV_STANDBY_PSC - 1 : 0;
+	TIM1->SWEVGR = TIM_UG;
+}
+
+static void TaskStandby()
+{
+	static uint32_t blank_since;
+	uint32_t now = SysTick->CNT;
+
+	if( display_lit || !standby_ticks )
+	{
+		blank_since = 0;
+		SetHVStandby( 0 );
+	}
+	else if( !blank_since )
+		blank_since = now | 1;
+	else if( now - blank_since > standby_ticks )
+		SetHVStandby( 1 );
+}
+
+// Which band value is in, given the band it was in last time.  The edge
+// nearest the current band moves away by hyst, so noise right on an edge
+// doesn't flip the gains back and forth.
+static int GainBand( int value, int band, const uint16_t * edges, int nedges,
+	int hyst )
+{
+	int b;
+	for( b = 0; b < nedges; b++ )
+	{
+		int edge = edges[b] + ( ( band > b ) ? -hyst : hyst );
+		if( value < edge ) break;
+	}
+	return b;
+}
+
+static void TaskGains()
+{
+	static uint8_t vdd_band;
+	static uint8_t hv_band;
+	vdd_band = GainBand( lastrefvdd >> VDD_IIR, vdd_band, gain_vdd_edges,
+		GAIN_VDD_BANDS - 1, GAIN_VDD_HYST );
+	hv_band = GainBand( target_feedback, hv_band, gain_hv_edges,
+		GAIN_HV_BANDS - 1, GAIN_HV_HYST );
+	int entry = vdd_band * GAIN_HV_BANDS + hv_band;
+	if( entry != gain_next )
+	{
+		gain_next = entry;
+		gain_update = 1;
+	}
+}
+
+static void SleepIfIdle()
+{
+	if( display_static && !display_commit && !latch_time_armed &&
+		!TasksPending() )
+	{
+		AccountPowerState( hv_standby ? POWER_STANDBY : POWER_IDLE );
+		__WFI();
+		AccountPowerState( POWER_RUN );
+	}
+}
+
+// RAM arena.
+//
+// We only have 2kB of RAM, and between the code we run from RAM, our data
+// and the stack, it's easy to run out.  So, buffers for the optional
+// features come out of one static arena, handed out once at startup.  Each
+// region is listed in ARENA_REGIONS with its size in bytes, and the total is
+// checked against ARENA_BUDGET at compile time.  Sizes must be plain
+// arithmetic (no sizeof), because they are also emitted as arena_size_*
+// symbols, which `make ramcheck` uses to check the whole RAM budget at link
+// time and to show what each feature costs.
+#define ARENA_BUDGET 512
+
+#ifdef ENABLE_LOAD_FEEDFORWARD
+#define ARENA_LOAD_FF( X ) X( load_ff, LOAD_FF_ENTRIES * 2 )
+#else
+#define ARENA_LOAD_FF( X )
+#endif
+
+#ifdef ENABLE_UART_TRANSPORT
+#define ARENA_UART( X ) X( uart_rx, UART_RX_SIZE )
+#else
+#define ARENA_UART( X )
+#endif
+
+#define ARENA_REGIONS( X ) \
+	ARENA_LOAD_FF( X ) \
+	ARENA_UART( X ) \
+	X( latency_histogram, LATENCY_BUCKETS * 2 ) \
+	X( setpoint_preload, SETPOINT_BANDS * 2 )
+
+#define ARENA_STR2( x ) #x
+#define ARENA_STR( x ) ARENA_STR2( x )
+#define ARENA_ROUND( size ) ( ( (size) + 3 ) & ~3 )
+#define ARENA_SIZE_ENTRY( name, size ) + ARENA_ROUND( size )
+#define ARENA_SYMBOL( name, size ) \
+	__asm__( ".globl arena_size_" #name "\n.set arena_size_" #name ", " ARENA_STR( size ) );
+#define ARENA_ASSIGN( name, size ) name = ArenaAlloc( size );
+
+#define ARENA_SIZE ( 0 ARENA_REGIONS( ARENA_SIZE_ENTRY ) )
+
+_Static_assert( ARENA_SIZE <= ARENA_BUDGET, "RAM arena over budget, see ARENA_REGIONS" );
+
+ARENA_REGIONS( ARENA_SYMBOL )
+
+static uint32_t arena[ARENA_SIZE/4];
+
+static void * ArenaAlloc( int size )
+{
+	static int used;
+	void * ret = (uint8_t*)arena + used;
+	used += ARENA_ROUND( size );
+	return ret;
+}
+
+static void SetupArena()
+{
+	ARENA_REGIONS( ARENA_ASSIGN )
+}
+
 int main()
 {
 	// Configure a watchdog timer so if the chip goes crazy it will reset.
@@ -555,6 +2648,9 @@ int main()
 	// Pet watchdog for the rest of startup.
 	WatchdogPet();
 
+	// Hand out feature buffers before any interrupts can use them.
+	SetupArena();
+
 	// Enable Peripherals
 	RCC->APB2PCENR |= RCC_APB2Periph_GPIOD | RCC_APB2Periph_GPIOC |
 		RCC_APB2Periph_GPIOA | RCC_APB2Periph_TIM1 | RCC_APB2Periph_ADC1 |
@@ -565,56 +2661,49 @@ int main()
 	// I'm paranoid - let's make sure all tube cathodes are high-Z.
 	ApplyOnMask( 0 );
 
-	GPIOD->CFGLR = 
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*6) | // GPIO D6 Debug
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP_AF)<<(4*7) | // DIG_AUX  (TIM2CH4)
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*3) | // DIG_9
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*2) | // DIG_8
-		(GPIO_Speed_10MHz | GPIO_CNF_IN_FLOATING)<<(4*1) | // PGM Floats.
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*0);  // DIG_DOT
-
-	GPIOC->CFGLR = 
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*0) | // DIG_0
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*1) | // DIG_1
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*2) | // DIG_2
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*3) | // DIG_3
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*4) | // DIG_4
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*5) | // DIG_5
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*6) | // DIG_6
-		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*7);  // DIG_7
+	// Cathode pins come from the tube profile, the rest (D6 Debug, D7
+	// DIG_AUX on TIM2CH4, D1 PGM) from the board description.  See
+	// tubeprofiles.h.
+	GPIOD->CFGLR = TUBE_GPIOD_CFGLR;
+	GPIOC->CFGLR = TUBE_GPIOC_CFGLR;
 
 
 	GPIOA->CFGLR =
 		(GPIO_Speed_50MHz | GPIO_CNF_OUT_PP_AF)<<(4*1); //FLYBACK (T1CH2)
 
+#ifdef ENABLE_FAST_ADC_IRQ
+	SetupFastAdcIrq();
+#endif
 	SetupADC();
 	SetupTimer1();
 	SetupTimer2();
 
-	*DMDATA0 = 0;
-
+	// Go straight to whatever we were told to boot into, if anything.
 	target_feedback = 0;
+	LoadCalibration();
+	ConfigLoad();
 
-	// Cause system timer to run and reload when it hits CMP and HCLK/8.
-	// Also, don't stop at comparison value.
-	SysTick->CTLR = 1;
+#ifdef ENABLE_UART_TRANSPORT
+	SetupUart();
+#endif
+
+	*DMDATA0 = 0;
+	*DMDATA1 = 0;
+
+	// Cause system timer to run at HCLK/8, and don't reset at the comparison
+	// value, but do interrupt on it.  That interrupt handles commands.
+	SysTick->CMP = COMMAND_POLL_TICKS;
+	SysTick->CTLR = SYSTICK_CTLR_STE | SYSTICK_CTLR_STIE;
+	NVIC_SetPriority( SysTicK_IRQn, 1<<7 );
+	NVIC_EnableIRQ( SysTicK_IRQn );
 
 	while(1)
 	{
-		uint32_t dmdword = *DMDATA0;
-		if( (dmdword & 0xf0) == 0x40 )
-		{
-			// I think there is a compiler bug here.  For some reason if I put
-			// the code in this function right here, it doesn't work right.
-			// so I encapsulated the code in a function.
-			//
-			// This function handles commands we get over the programming
-			// interface.  Like "set HV bus" or "set this digit on."
-			HandleCommand( dmdword );
-		}
-
 		AdvanceFadePlace();
 
+		RunTasks();
+
+		SleepIfIdle();
 	}
 }
 
@@ -40,8 +40,11 @@
  *            OB_RST_EN_DT1ms - Reset IO enable (PD7) and  Ignore delay time 1ms
  *            OB_RST_EN_DT128ms - Reset IO enable (PD7) and  Ignore delay time 128ms
 */
+#ifndef OB_IWDG_MODE
+#define OB_IWDG_MODE OB_IWDG_SW  // Or OB_IWDG_HW, see the Makefile.
+#endif
 	uint16_t OB_STOP = OB_STOP_NoRST;
-	uint16_t OB_IWDG = OB_IWDG_SW;
+	uint16_t OB_IWDG = OB_IWDG_MODE;
 	uint16_t OB_STDBY = OB_STDBY_NoRST;
 	uint16_t OB_RST = OB_RST_NoEN;
 
@@ -66,8 +69,27 @@ int main()
 
 	printf( "Option bytes started as:%04x\n", OB->USER );
 
+	// With OB_IWDG_HW this runs again after every watchdog reset until the
+	// next image is flashed, so don't erase and write them again (and race
+	// whoever is reading them back) if they're already right.
+	uint8_t user = OB_IWDG | OB_STOP | OB_STDBY | OB_RST | 0xE0;
+	if( ( OB->USER & 0xff ) == user )
+	{
+		printf( "Already set\n" );
+		goto done;
+	}
+
 	uint16_t rdptmp = RDP_Key;
 
+	// Erasing clears all the option bytes, so keep the user data bytes, which
+	// nixitest1 keeps its HV calibration in.  Only ones that were written,
+	// i.e. the top byte is the complement of the bottom; writing back an
+	// erased 0xff would make it look like a trim of -1.
+	uint16_t data0 = OB->Data0;
+	uint16_t data1 = OB->Data1;
+	int keep0 = ( ( ( data0 >> 8 ) ^ data0 ) & 0xff ) == 0xff;
+	int keep1 = ( ( ( data1 >> 8 ) ^ data1 ) & 0xff ) == 0xff;
+
 
 	int status = FLASH_WaitForLastOperation(EraseTimeout);
 	if(status == FLASH_COMPLETE)
@@ -113,6 +135,16 @@ int main()
         OB->USER = OB_IWDG | (uint16_t)(OB_STOP | (uint16_t)(OB_STDBY | (uint16_t)(OB_RST | (uint16_t)0xE0)));
 
         status = FLASH_WaitForLastOperation(10000);
+        if(status == FLASH_COMPLETE && keep0)
+        {
+            OB->Data0 = (uint8_t)data0;
+            status = FLASH_WaitForLastOperation(10000);
+        }
+        if(status == FLASH_COMPLETE && keep1)
+        {
+            OB->Data1 = (uint8_t)data1;
+            status = FLASH_WaitForLastOperation(10000);
+        }
         if(status != FLASH_TIMEOUT)
         {
             FLASH->CTLR &= CR_OPTPG_Reset;
@@ -120,9 +152,13 @@ int main()
     }
 
 	printf( "After Write:%04x\n", OB->USER );
+	printf( "Data:%04x %04x\n", OB->Data0, OB->Data1 );
+done:
 	printf( "Done\n" );
 
-	while(1);
+	// The watchdog may be on in hardware now, keep it fed so we don't reset.
+	while(1)
+		IWDG->CTLR = 0xAAAA;
 }
 
 
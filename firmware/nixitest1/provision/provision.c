@@ -0,0 +1,285 @@
+// Batch provisioning for nixitest1 boards.
+//
+// Runs every attached programmer at once, one worker process per slot, and
+// for each board:
+//   1. Flashes and runs optionbytes (build it with `make images`, which sets
+//      the reset pin as GPIO and the hardware watchdog), then reads the
+//      option bytes back to check the USER byte.
+//   2. Flashes nixitest1 and reads the flash back to verify it.
+//   3. Calibrates VREF against the fixture's supply (command 13, step 1),
+//      and writes the trim into the option bytes (step 3).
+//   4. Reads back the trims, from the option bytes themselves, and checks
+//      they match what the firmware is using.
+// Then prints a report, one line per board, and also writes it as CSV.
+//
+// It runs the minichlink command line tool for each step, so each slot is
+// just the arguments that pick that programmer, for example:
+//   ./provision -V 5000 -s "-c /dev/ttyACM0" -s "-c /dev/ttyACM1"
+// With no -s, there's one slot, with minichlink's default programmer.
+//
+// The divider trim (step 2 of command 13) needs a meter on the HV, so it is
+// not done here.  Each step's minichlink output goes to slotN.log.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_SLOTS 16
+
+const char * minichlink = "../../ch32v003fun/minichlink/minichlink";
+const char * optionbytes_bin = "../optionbytes/optionbytes.bin";
+const char * firmware_bin = "../nixitest1.bin";
+const char * report_csv = "provision_report.csv";
+int expect_user = 0xfe;  // IWDG_HW, STOP_NoRST, STDBY_NoRST, RST_NoEN.
+int vdd_mv = 0;          // Fixture supply, 0 to skip calibration.
+
+const char * slot_args[MAX_SLOTS];
+int num_slots;
+
+struct Report
+{
+	int slot;
+	int ok;
+	int user;
+	int flash_ok;
+	int cal_vref;
+	int cal_divider;
+	int seconds;
+	char failed[32];
+};
+
+int Run( int slot, const char * fmt, ... ) __attribute__((format(printf, 2, 3)));
+
+// Run minichlink for this slot, with its output appended to the log.  The
+// output is also kept in last_output for Run callers that need a reply.
+char last_output[4096];
+
+int Run( int slot, const char * fmt, ... )
+{
+	char args[512];
+	char cmd[1024];
+	va_list ap;
+	va_start( ap, fmt );
+	vsnprintf( args, sizeof( args ), fmt, ap );
+	va_end( ap );
+
+	snprintf( cmd, sizeof( cmd ), "%s %s %s 2>&1", minichlink,
+		slot_args[slot] ? slot_args[slot] : "", args );
+
+	char logname[32];
+	snprintf( logname, sizeof( logname ), "slot%d.log", slot );
+	FILE * log = fopen( logname, "a" );
+	if( log ) fprintf( log, "$ %s\n", cmd );
+
+	FILE * p = popen( cmd, "r" );
+	if( !p )
+	{
+		if( log ) fclose( log );
+		return -1;
+	}
+	int len = fread( last_output, 1, sizeof( last_output ) - 1, p );
+	last_output[len < 0 ? 0 : len] = 0;
+	int status = pclose( p );
+	if( log )
+	{
+		fputs( last_output, log );
+		fclose( log );
+	}
+	return ( WIFEXITED( status ) ) ? WEXITSTATUS( status ) : -1;
+}
+
+// The last "0x..." in what minichlink printed, which is how -g replies.
+int LastHex( uint32_t * value )
+{
+	char * p = last_output;
+	char * found = 0;
+	while( ( p = strstr( p, "0x" ) ) )
+		found = p++;
+	if( !found ) return -1;
+	*value = strtoul( found, 0, 16 );
+	return 0;
+}
+
+uint8_t * LoadFile( const char * fname, int * len )
+{
+	FILE * f = fopen( fname, "rb" );
+	if( !f ) return 0;
+	fseek( f, 0, SEEK_END );
+	*len = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	uint8_t * data = malloc( *len );
+	if( fread( data, 1, *len, f ) != *len )
+	{
+		free( data );
+		data = 0;
+	}
+	fclose( f );
+	return data;
+}
+
+// Send a command word the legacy way, and get its reply from DMDATA1.
+int Command( int slot, uint32_t word, uint32_t * reply )
+{
+	if( Run( slot, "-s 0x04 0x%08x", word ) ) return -1;
+	usleep( 20000 );
+	if( Run( slot, "-g 0x05" ) ) return -1;
+	return reply ? LastHex( reply ) : 0;
+}
+
+#define FAIL( step ) { snprintf( r->failed, sizeof( r->failed ), "%s", step ); return; }
+
+// A trim as nixitest1 reads it from an option byte: only if the top byte is
+// the complement of the bottom, else it was never written and there's none.
+int ObTrim( uint8_t lo, uint8_t hi )
+{
+	return ( ( lo ^ hi ) == 0xff ) ? (int8_t)lo : 0;
+}
+
+void Provision( int slot, struct Report * r )
+{
+	char tmpname[32];
+	int len, fwlen;
+	uint8_t * data;
+
+	// 1. Option bytes.
+	if( Run( slot, "-w %s flash -b", optionbytes_bin ) ) FAIL( "flash optionbytes" );
+	sleep( 1 );
+	snprintf( tmpname, sizeof( tmpname ), "slot%d_ob.bin", slot );
+	if( Run( slot, "-r %s 0x1ffff800 16", tmpname ) ) FAIL( "read option bytes" );
+	data = LoadFile( tmpname, &len );
+	if( !data || len < 4 ) FAIL( "read option bytes" );
+	r->user = data[2];
+	free( data );
+	if( r->user != expect_user ) FAIL( "option bytes" );
+
+	// 2. Firmware.
+	if( Run( slot, "-w %s flash -b", firmware_bin ) ) FAIL( "flash firmware" );
+	uint8_t * firmware = LoadFile( firmware_bin, &fwlen );
+	if( !firmware ) FAIL( "load firmware" );
+	snprintf( tmpname, sizeof( tmpname ), "slot%d_fw.bin", slot );
+	int readback = Run( slot, "-r %s 0x08000000 %d", tmpname, fwlen );
+	data = LoadFile( tmpname, &len );
+	r->flash_ok = !readback && data && len == fwlen &&
+		memcmp( data, firmware, fwlen ) == 0;
+	free( data );
+	free( firmware );
+	if( !r->flash_ok ) FAIL( "verify firmware" );
+
+	// Let VDD's IIR settle.
+	sleep( 1 );
+
+	// 3. VREF calibration against the fixture supply.
+	uint32_t reply = 0;
+	if( vdd_mv )
+	{
+		if( Command( slot, 0x0000044d, 0 ) ) FAIL( "calibrate" );
+		if( Command( slot, ( (uint32_t)vdd_mv << 16 ) | 0x014d, 0 ) ) FAIL( "calibrate" );
+		if( Command( slot, 0x0000034d, 0 ) ) FAIL( "write calibration" );
+		sleep( 1 );
+	}
+
+	// 4. Read back.  The command only replies with what's in RAM, so also
+	// read the option bytes, which are what the next boot will use.
+	if( Command( slot, 0x0000004d, &reply ) ) FAIL( "read calibration" );
+	r->cal_vref = (int8_t)reply;
+	r->cal_divider = (int8_t)( reply >> 8 );
+	snprintf( tmpname, sizeof( tmpname ), "slot%d_ob.bin", slot );
+	if( Run( slot, "-r %s 0x1ffff800 16", tmpname ) ) FAIL( "read option bytes" );
+	data = LoadFile( tmpname, &len );
+	if( !data || len < 8 ) FAIL( "read option bytes" );
+	int ob_vref = ObTrim( data[4], data[5] );
+	int ob_divider = ObTrim( data[6], data[7] );
+	free( data );
+	if( ob_vref != r->cal_vref || ob_divider != r->cal_divider )
+		FAIL( "verify calibration" );
+	// A trim at the limit means the reading was off, not the part.
+	if( vdd_mv && ( r->cal_vref >= 127 || r->cal_vref <= -127 ) )
+		FAIL( "vref out of range" );
+	r->ok = 1;
+}
+
+int main( int argc, char ** argv )
+{
+	int c;
+	while( ( c = getopt( argc, argv, "m:o:f:u:V:r:s:" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 'm': minichlink = optarg; break;
+		case 'o': optionbytes_bin = optarg; break;
+		case 'f': firmware_bin = optarg; break;
+		case 'u': expect_user = strtoul( optarg, 0, 0 ); break;
+		case 'V': vdd_mv = atoi( optarg ); break;
+		case 'r': report_csv = optarg; break;
+		case 's':
+			if( num_slots < MAX_SLOTS ) slot_args[num_slots++] = optarg;
+			break;
+		default:
+			fprintf( stderr, "Usage: %s [-m minichlink] [-o optionbytes.bin] [-f nixitest1.bin]\n"
+				"  [-u expected USER byte] [-V fixture VDD in mV] [-r report.csv]\n"
+				"  [-s \"programmer args\"]...\n", argv[0] );
+			return -1;
+		}
+	}
+	if( !num_slots ) num_slots = 1;
+
+	// One worker per slot, each sends its report back over a pipe.
+	int pipes[MAX_SLOTS];
+	pid_t pids[MAX_SLOTS];
+	int i;
+	for( i = 0; i < num_slots; i++ )
+	{
+		int fd[2];
+		if( pipe( fd ) ) { perror( "pipe" ); return -1; }
+		pids[i] = fork();
+		if( pids[i] == 0 )
+		{
+			close( fd[0] );
+			struct Report r = { 0 };
+			time_t start = time( 0 );
+			r.slot = i;
+			Provision( i, &r );
+			r.seconds = time( 0 ) - start;
+			if( write( fd[1], &r, sizeof( r ) ) != sizeof( r ) ) _exit( 1 );
+			_exit( 0 );
+		}
+		close( fd[1] );
+		pipes[i] = fd[0];
+	}
+
+	FILE * csv = fopen( report_csv, "w" );
+	if( csv ) fprintf( csv, "slot,programmer,result,user,flash,cal_vref,cal_divider,seconds\n" );
+	printf( "%-4s %-24s %-6s %-5s %-6s %-5s %-5s %s\n",
+		"slot", "programmer", "result", "user", "flash", "vref", "div", "time" );
+
+	int passed = 0;
+	for( i = 0; i < num_slots; i++ )
+	{
+		struct Report r = { 0 };
+		r.slot = i;
+		if( read( pipes[i], &r, sizeof( r ) ) != sizeof( r ) )
+			strcpy( r.failed, "worker died" );
+		close( pipes[i] );
+		waitpid( pids[i], 0, 0 );
+
+		const char * result = r.ok ? "PASS" : r.failed;
+		const char * programmer = slot_args[i] ? slot_args[i] : "(default)";
+		printf( "%-4d %-24s %-6s 0x%02x  %-6s %-5d %-5d %ds\n", i, programmer,
+			r.ok ? "PASS" : "FAIL", r.user, r.flash_ok ? "ok" : "-",
+			r.cal_vref, r.cal_divider, r.seconds );
+		if( !r.ok ) printf( "     failed at: %s, see slot%d.log\n", r.failed, i );
+		if( csv ) fprintf( csv, "%d,\"%s\",%s,0x%02x,%d,%d,%d,%d\n", i, programmer,
+			result, r.user, r.flash_ok, r.cal_vref, r.cal_divider, r.seconds );
+		passed += r.ok;
+	}
+	if( csv ) fclose( csv );
+
+	printf( "%d of %d boards passed\n", passed, num_slots );
+	return ( passed == num_slots ) ? 0 : 1;
+}
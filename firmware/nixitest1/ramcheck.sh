@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Link-time RAM budget check for the CH32V003.
+#
+# Usage: ramcheck.sh <nm> <elf> [budget] [stack_reserve] [flash_limit]
+#
+# Lists every symbol in RAM, grouped by the part of its name before the first
+# underscore, breaks the static arena down by region (from the arena_size_*
+# symbols the firmware emits), and fails if the end of static RAM plus the
+# space we keep for the stack does not fit in the budget.  If flash_limit is
+# given, it also fails if the flash image (text + data, from size) runs into
+# it, which is where the configuration store starts.
+#
+
+NM=$1
+ELF=$2
+BUDGET=${3:-2048}
+STACK=${4:-256}
+FLASH_LIMIT=$5
+
+if [ -z "$NM" ] || [ ! -f "$ELF" ]; then
+	echo "Usage: $0 <nm> <elf> [budget] [stack_reserve] [flash_limit]" >&2
+	exit 2
+fi
+
+# --size-sort leaves out the zero-size absolute arena_size_* symbols, so
+# those come from a second, plain, nm.
+{ "$NM" -S --size-sort "$ELF"; "$NM" "$ELF" | grep ' [aA] arena_size_'; } | awk -v budget="$BUDGET" -v stack="$STACK" -v ramstart=536870912 -v ramsize=2048 '
+BEGIN { ramend = ramstart }
+function hex( s,   i, v ) {
+	v = 0;
+	s = tolower( s );
+	for( i = 1; i <= length( s ); i++ )
+		v = v * 16 + index( "0123456789abcdef", substr( s, i, 1 ) ) - 1;
+	return v;
+}
+{
+	if( NF == 4 )
+	{
+		addr = hex( $1 ); size = hex( $2 ); type = $3; name = $4;
+		# All of physical RAM, so anything past the budget still counts.
+		if( addr < ramstart || addr >= ramstart + ramsize ) next;
+		if( type ~ /[tT]/ ) group = "(ram code)";
+		else { group = name; sub( /_.*/, "", group ); }
+		groups[group] += size;
+		if( addr + size > ramend ) ramend = addr + size;
+	}
+	else if( NF == 3 && $2 ~ /^[aA]$/ && $3 ~ /^arena_size_/ )
+	{
+		region = $3; sub( /^arena_size_/, "", region );
+		arena[region] = hex( $1 );
+	}
+}
+END {
+	printf( "RAM by group:\n" );
+	for( g in groups ) printf( "  %-24s %5d\n", g, groups[g] );
+	printf( "Arena regions:\n" );
+	for( r in arena ) printf( "  %-24s %5d\n", r, arena[r] );
+	used = ramend - ramstart;
+	printf( "Static RAM %d + stack reserve %d of %d bytes\n", used, stack, budget );
+	if( used + stack > budget )
+	{
+		printf( "RAM over budget by %d bytes\n", used + stack - budget );
+		exit 1;
+	}
+}' || exit 1
+
+if [ -n "$FLASH_LIMIT" ]; then
+	"${NM%nm}size" "$ELF" | awk -v limit="$FLASH_LIMIT" '
+	NR == 2 {
+		used = $1 + $2;
+		printf( "Flash %d of %d bytes\n", used, limit );
+		if( used > limit )
+		{
+			printf( "Flash image runs into the config store by %d bytes\n", used - limit );
+			exit 1;
+		}
+	}' || exit 1
+fi
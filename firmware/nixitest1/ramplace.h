@@ -0,0 +1,11 @@
+// Generated by ramplace, do not edit.  See ramplace/ramplace.c.
+// Hand placement: the ADC interrupt (in both builds) and HandleFade.
+#ifndef _RAMPLACE_H
+#define _RAMPLACE_H
+
+#define RAMPLACE_ADC1_IRQHandler 1
+#define RAMPLACE_AdcIsrBody 1
+#define RAMPLACE_AdcFastEntry 1
+#define RAMPLACE_HandleFade 1
+
+#endif
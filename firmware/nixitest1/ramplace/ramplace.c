@@ -0,0 +1,300 @@
+// Profile-guided RAM placement for nixitest1.
+//
+// Code in RAM runs without flash wait states, but we only have 2kB of RAM.
+// This takes the function sizes (from nm -S on the elf) and a cycle profile,
+// ranks functions by hot cycles per byte, and picks as many as will fit in
+// the RAM budget.  The result is ramplace.h, which the firmware includes,
+// and which turns RAMPLACE( fn ) into the .srodata attribute for the chosen
+// functions.
+//
+// The profile is one entry per line, either "function cycles" (from an
+// instruction set simulator) or "0xaddress samples" (from PC sampling on
+// chip), which get attributed to the function containing that address.
+// Lines starting with # are ignored.
+//
+// Only functions annotated with RAMPLACE( fn ) in the source can move, so
+// those are the only candidates; the source files to scan for them are given
+// with -s.  Hot functions that aren't annotated are listed, since annotating
+// them might be worth it.
+//
+// Usage:
+//   ramplace [-b budget] [-p penalty%] [-o ramplace.h] -s nixitest1.c...
+//     nm.txt profile.txt [profile_after.txt]
+//
+// The expected saving is penalty% of the cycles in the chosen functions, the
+// flash wait state cost.  If a second profile, taken with the new placement,
+// is given, the measured saving is the difference for the same functions.
+// The chosen functions move, so a PC sampled second profile has to be taken
+// against the new elf and turned into names first.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MAX_FUNCS 1024
+#define MAX_MOVABLE 64
+#define MAX_SOURCES 8
+
+struct Func
+{
+	char name[128];
+	uint32_t addr;
+	uint32_t size;
+	uint64_t cycles;
+	uint64_t cycles_after;
+	int movable;
+	int chosen;
+};
+
+struct Func funcs[MAX_FUNCS];
+int num_funcs;
+
+char movable[MAX_MOVABLE][128];
+int num_movable;
+
+// Collect the names in RAMPLACE( name ), skipping comments and #defines.
+int LoadSource( const char * fname )
+{
+	FILE * f = fopen( fname, "r" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't open %s\n", fname );
+		return -1;
+	}
+	char line[512];
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		char * comment = strstr( line, "//" );
+		if( comment )
+			*comment = 0;
+		char * p = line;
+		while( *p == ' ' || *p == '\t' )
+			p++;
+		if( *p == '#' )
+			continue;
+		while( ( p = strstr( p, "RAMPLACE(" ) ) )
+		{
+			char name[128];
+			p += strlen( "RAMPLACE(" );
+			if( sscanf( p, " %127[A-Za-z0-9_]", name ) != 1 )
+				continue;
+			if( num_movable == MAX_MOVABLE )
+				break;
+			strcpy( movable[num_movable++], name );
+		}
+	}
+	fclose( f );
+	return 0;
+}
+
+int IsMovable( const char * name )
+{
+	int i;
+	for( i = 0; i < num_movable; i++ )
+		if( strcmp( movable[i], name ) == 0 )
+			return 1;
+	return 0;
+}
+
+struct Func * FindByName( const char * name )
+{
+	int i;
+	for( i = 0; i < num_funcs; i++ )
+		if( strcmp( funcs[i].name, name ) == 0 )
+			return &funcs[i];
+	return 0;
+}
+
+struct Func * FindByAddr( uint32_t addr )
+{
+	int i;
+	for( i = 0; i < num_funcs; i++ )
+		if( addr >= funcs[i].addr && addr < funcs[i].addr + funcs[i].size )
+			return &funcs[i];
+	return 0;
+}
+
+int LoadNM( const char * fname )
+{
+	FILE * f = fopen( fname, "r" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't open %s\n", fname );
+		return -1;
+	}
+	char line[512];
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		unsigned addr, size;
+		char type;
+		char name[128];
+		if( sscanf( line, "%x %x %c %127s", &addr, &size, &type, name ) != 4 )
+			continue;
+		if( type != 't' && type != 'T' )
+			continue;
+		if( num_funcs == MAX_FUNCS )
+			break;
+		// Drop GCC's clone suffixes, like .constprop.0, they still come
+		// from the same function in the source.
+		char * dot = strchr( name, '.' );
+		if( dot )
+			*dot = 0;
+		struct Func * fn = &funcs[num_funcs++];
+		strcpy( fn->name, name );
+		fn->addr = addr;
+		fn->size = size;
+		fn->movable = IsMovable( name );
+	}
+	fclose( f );
+	return 0;
+}
+
+int LoadProfile( const char * fname, int after )
+{
+	FILE * f = fopen( fname, "r" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't open %s\n", fname );
+		return -1;
+	}
+	char line[512];
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		char what[128];
+		unsigned long long count;
+		if( line[0] == '#' || sscanf( line, "%127s %llu", what, &count ) != 2 )
+			continue;
+		struct Func * fn = ( strncmp( what, "0x", 2 ) == 0 ) ?
+			FindByAddr( strtoul( what, 0, 16 ) ) : FindByName( what );
+		if( !fn )
+			continue;
+		if( after )
+			fn->cycles_after += count;
+		else
+			fn->cycles += count;
+	}
+	fclose( f );
+	return 0;
+}
+
+int CompareDensity( const void * a, const void * b )
+{
+	const struct Func * fa = a;
+	const struct Func * fb = b;
+	// cycles/size, compared without dividing.
+	uint64_t da = fa->cycles * ( fb->size ? fb->size : 1 );
+	uint64_t db = fb->cycles * ( fa->size ? fa->size : 1 );
+	return ( da < db ) ? 1 : ( da > db ) ? -1 : 0;
+}
+
+int main( int argc, char ** argv )
+{
+	int budget = 768;
+	int i;
+	int penalty = 20;
+	const char * outname = "ramplace.h";
+	const char * sources[MAX_SOURCES];
+	int num_sources = 0;
+	int arg = 1;
+
+	while( arg < argc && argv[arg][0] == '-' && arg + 1 < argc )
+	{
+		switch( argv[arg][1] )
+		{
+		case 'b': budget = atoi( argv[arg+1] ); break;
+		case 'p': penalty = atoi( argv[arg+1] ); break;
+		case 'o': outname = argv[arg+1]; break;
+		case 's':
+			if( num_sources < MAX_SOURCES )
+				sources[num_sources++] = argv[arg+1];
+			break;
+		default:
+			fprintf( stderr, "Error: unknown option %s\n", argv[arg] );
+			return -1;
+		}
+		arg += 2;
+	}
+
+	if( argc - arg < 2 || !num_sources )
+	{
+		fprintf( stderr, "Usage: %s [-b budget] [-p penalty%%] [-o ramplace.h] -s source.c... nm.txt profile.txt [profile_after.txt]\n", argv[0] );
+		return -1;
+	}
+
+	for( i = 0; i < num_sources; i++ )
+		if( LoadSource( sources[i] ) )
+			return -1;
+	if( LoadNM( argv[arg] ) || LoadProfile( argv[arg+1], 0 ) )
+		return -1;
+	int have_after = argc - arg > 2;
+	if( have_after && LoadProfile( argv[arg+2], 1 ) )
+		return -1;
+
+	qsort( funcs, num_funcs, sizeof( funcs[0] ), CompareDensity );
+
+	// Greedy by density, over the functions that can move.  Functions are
+	// word aligned in RAM.
+	int used = 0;
+	uint64_t total = 0, chosen_cycles = 0, chosen_after = 0;
+	for( i = 0; i < num_funcs; i++ )
+	{
+		struct Func * fn = &funcs[i];
+		int size = ( fn->size + 3 ) & ~3;
+		total += fn->cycles;
+		if( !fn->movable || !fn->cycles || used + size > budget )
+			continue;
+		fn->chosen = 1;
+		used += size;
+		chosen_cycles += fn->cycles;
+		chosen_after += fn->cycles_after;
+	}
+
+	FILE * f = fopen( outname, "w" );
+	if( !f )
+	{
+		fprintf( stderr, "Error: can't write %s\n", outname );
+		return -1;
+	}
+	fprintf( f, "// Generated by ramplace, do not edit.  See ramplace/ramplace.c.\n" );
+	fprintf( f, "// %d of %d bytes of RAM, %llu of %llu profiled cycles.\n",
+		used, budget, (unsigned long long)chosen_cycles, (unsigned long long)total );
+	fprintf( f, "#ifndef _RAMPLACE_H\n#define _RAMPLACE_H\n\n" );
+	printf( "%-32s %6s %12s %10s\n", "function", "bytes", "cycles", "cyc/byte" );
+	for( i = 0; i < num_funcs; i++ )
+	{
+		struct Func * fn = &funcs[i];
+		if( !fn->chosen )
+			continue;
+		fprintf( f, "#define RAMPLACE_%s 1\n", fn->name );
+		printf( "%-32s %6u %12llu %10llu\n", fn->name, fn->size,
+			(unsigned long long)fn->cycles,
+			(unsigned long long)( fn->cycles / ( fn->size ? fn->size : 1 ) ) );
+	}
+	fprintf( f, "\n#endif\n" );
+	fclose( f );
+
+	// Hot, but can't move without a RAMPLACE( fn ) in the source.
+	int shown = 0;
+	for( i = 0; i < num_funcs && shown < 5; i++ )
+	{
+		struct Func * fn = &funcs[i];
+		if( fn->movable || !fn->cycles )
+			continue;
+		if( !shown++ )
+			printf( "Not annotated, so not placed:\n" );
+		printf( "  %-30s %6u %12llu\n", fn->name, fn->size,
+			(unsigned long long)fn->cycles );
+	}
+
+	printf( "RAM used: %d of %d bytes\n", used, budget );
+	printf( "Expected saving: %llu of %llu cycles (%d%% of the cycles moved)\n",
+		(unsigned long long)( chosen_cycles * penalty / 100 ),
+		(unsigned long long)total, penalty );
+	if( have_after )
+	{
+		long long saved = (long long)chosen_cycles - (long long)chosen_after;
+		printf( "Measured saving: %lld cycles\n", saved );
+	}
+	return 0;
+}
@@ -8,9 +8,45 @@ struct MiniChlinkFunctions * MCFO;
 
 //#define ENABLE_TUNING
 
+// Use the pipelined protocol (commands in RAM slots, a doorbell and ack in
+// DMDATA0), so we don't wait for each command's ack, or, with that off, the
+// sequenced DMDATA0/DMDATA1 protocol instead of the legacy one-word protocol.
+// See PollDebugMailbox() in nixitest1.c.
+#define USE_PIPELINED_PROTOCOL
+#define USE_SEQUENCED_PROTOCOL
+
+#ifdef USE_PIPELINED_PROTOCOL
+// Must match nixitest1.c.
+#define COMMAND_SLOTS 8
+#define COMMAND_SLOT_SIZE 12
+uint32_t command_slots;  // Address, from query 12.
+int acked_seq = 0xf;
+uint32_t last_ack;
+
+// Ask where the command slots are, the legacy way, once at startup.
+int FindCommandSlots( void * dev )
+{
+	int timeout;
+	uint32_t status = 0x40;
+	MCFO->WriteReg32( dev, DMDATA0, 0x00000c49 );
+	for( timeout = 0; ( status & 0xf0 ) == 0x40 && timeout < 100; timeout++ )
+		MCFO->ReadReg32( dev, DMDATA0, &status );
+	if( MCFO->ReadReg32( dev, DMDATA1, &command_slots ) || !command_slots )
+		return -1;
+	// The query also restarted the firmware's numbering at our seq = 0xf.
+	return 0;
+}
+#endif
+
 int targetnum = 0;
 int debugregs = 0;
 int lastsettarget = -1;
+
+// This unit's VREF and divider trims, in 1/1024ths, read once at startup
+// with command 13.  See ApplyCalibration() in nixitest1.c.
+int have_calibration = 0;
+int cal_vref = 0;
+int cal_divider = 0;
 #define VOLTAGE_SCALE 2.01
 
 const char * targdisp[] = { "D", "F", " ", "0", "9", "8", "7", "6", "5", "4", "3", "2", "1", ".", "N" };
@@ -70,6 +106,14 @@ int main()
 
 	MCFO->WriteReg32( dev, DMABSTRACTAUTO, 0 );
 
+#ifdef USE_PIPELINED_PROTOCOL
+	if( FindCommandSlots( dev ) )
+	{
+		fprintf( stderr, "Error: Couldn't find the command slots\n" );
+		return -9;
+	}
+#endif
+
 	printf( "DEV: %p\n", dev );
 	CNFGSetup( "nixitest1 debug app", 640, 570 );
 	while(CNFGHandleInput())
@@ -106,7 +150,11 @@ int main()
 
 		uint32_t rmask = 0;
 
-		if( do_set )
+		if( !have_calibration )
+		{
+			rmask = 0x0000004d;
+		}
+		else if( do_set )
 		{
 			do_set = 0;
 			float set_v = (450 - sety)/2;
@@ -181,10 +229,39 @@ int main()
 		else
 		{
 			rmask = 0x00000040;
+#ifndef USE_PIPELINED_PROTOCOL
 			MCFO->WriteReg32( dev, DMDATA0, 0x00000040 );
+#endif
 		}
 
+#ifdef USE_PIPELINED_PROTOCOL
+		// The command goes in its slot, then the doorbell, the newest
+		// sequence number, into DMDATA0.  We don't wait for the ack, we pick
+		// it up next frame.  Don't get more than the slots ahead, though.
+		static int seq = 0xf;
+		static int cal_seq = -1;
+		if( ( ( seq - acked_seq ) & 0xf ) < COMMAND_SLOTS - 1 )
+		{
+			seq = ( seq + 1 ) & 0xf;
+			uint32_t slot = command_slots + 4 +
+				( seq & ( COMMAND_SLOTS - 1 ) ) * COMMAND_SLOT_SIZE;
+			MCFO->WriteWord( dev, slot, rmask );
+			MCFO->WriteWord( dev, slot + 4, 0 );
+			if( rmask == 0x0000004d ) cal_seq = seq;
+		}
+		// Rung every frame; if our last one was lost under an ack, this is
+		// the resend, and it never runs anything twice.
+		MCFO->WriteReg32( dev, DMDATA0, 0x70 | seq );
+#elif defined( USE_SEQUENCED_PROTOCOL )
+		// The command word goes in DMDATA1, then the sequence number into
+		// DMDATA0 kicks it off.  The firmware acks with the same sequence.
+		static int seq;
+		seq = ( seq + 1 ) & 0xf;
+		MCFO->WriteReg32( dev, DMDATA1, rmask );
+		MCFO->WriteReg32( dev, DMDATA0, 0x50 | seq );
+#else
 		MCFO->WriteReg32( dev, DMDATA0, rmask );
+#endif
 
 		uint32_t status = 0xffffffff;
 		int r;
@@ -232,12 +309,42 @@ int main()
 		int timeout;
 		timeout = 0;
 		const int maxtimeout = 30;
+#ifdef USE_PIPELINED_PROTOCOL
+		// Whatever the newest ack is.  If the firmware hasn't picked up the
+		// doorbell yet, the status from the last one still stands.
+		r = MCFO->ReadReg32( dev, DMDATA0, &status );
+		if( !r && ( status & 0xf0 ) == 0x20 )
+		{
+			int newly = ( ( status & 0xf ) - acked_seq ) & 0xf;
+			if( cal_seq >= 0 && ( ( cal_seq - acked_seq ) & 0xf ) <= newly &&
+				cal_seq != acked_seq )
+			{
+				uint32_t reply = 0;
+				MCFO->ReadWord( dev, command_slots + 4 + 8 +
+					( cal_seq & ( COMMAND_SLOTS - 1 ) ) * COMMAND_SLOT_SIZE, &reply );
+				cal_vref = (int8_t)reply;
+				cal_divider = (int8_t)( reply >> 8 );
+				have_calibration = 1;
+				cal_seq = -1;
+			}
+			acked_seq = status & 0xf;
+			last_ack = status;
+		}
+		else if( !r && last_ack )
+			status = last_ack;
+#else
 		retry:
 		status = 0xffffffc0;
 		r = MCFO->ReadReg32( dev, DMDATA0, &status );
 
+#ifdef USE_SEQUENCED_PROTOCOL
+		if( ( ( status & 0xef ) != ( 0x20 | seq ) )  && timeout++ < maxtimeout ) goto retry;
+		if( ( status & 0xf0 ) == 0x30 ) printf( "Lost command before seq %d\n", seq );
+#else
 		if( ( ( status & 0xc0 ) == 0x40 || status == 0 || status == 0xffffffff )  && timeout++ < maxtimeout ) goto retry;
+#endif
 		if( r && timeout++ < maxtimeout ) { printf( "R: %d\n", r ); status = 0; goto retry; }
+#endif
 		
 		if( timeout >= maxtimeout )
 		{
@@ -260,9 +367,23 @@ int main()
 			sprintf( cts, "%08x", status );
 			CNFGDrawText( cts, 2 );
 
-			float voltvdd = 1.20/(((status>>22)&0x3ff)/1023.0f); // vref = 2.2v
-			float voltage = ((((float)((status>>12)&0x3ff))/1023.0f)*101.0)*voltvdd; //101 because it's 10k + 1M
-			// Measured @ 176 reported here, but 180 in reality if ref is 1.2.  But 1.21 fixes it.
+#ifndef USE_PIPELINED_PROTOCOL
+			if( rmask == 0x0000004d )
+			{
+				uint32_t reply = 0;
+				MCFO->ReadReg32( dev, DMDATA1, &reply );
+				cal_vref = (int8_t)reply;
+				cal_divider = (int8_t)( reply >> 8 );
+				have_calibration = 1;
+			}
+#endif
+
+			// Nominally vref = 1.2v and the divider is 101, but both are off a
+			// bit per unit, and this used to read ~4V low, so use the trims.
+			float vref = 1.20 * ( 1 + cal_vref / 1024.0f );
+			float divider = 101.0 * ( 1 + cal_divider / 1024.0f ); //101 because it's 10k + 1M
+			float voltvdd = vref/(((status>>22)&0x3ff)/1023.0f);
+			float voltage = ((((float)((status>>12)&0x3ff))/1023.0f)*divider)*voltvdd;
 			volthist[volthisthead] = voltage;
 			volthistvdd[volthisthead] = voltvdd;
 			volthisthead = (volthisthead + 1) % VOLTHISTSIZE;
@@ -0,0 +1,104 @@
+//
+// Board and tube descriptions for cnixi.
+//
+// Each tube profile is a list of which pin drives the cathode for each
+// segment number the host can ask for (segment 0 is always "all off"). The
+// segment-to-port-bits table, the number of segments, and the CFGLR setup of
+// the cathode pins are all generated from that list at compile time, so to
+// wire up a new tube or board, you only add a list here.
+//
+// Select the tube with -DTUBE_IN12 (or add your own), the default is IN-15.
+//
+
+#ifndef _TUBEPROFILES_H
+#define _TUBEPROFILES_H
+
+#define PORT_C 0
+#define PORT_D 1
+
+#if defined( TUBE_IN12 )
+
+// IN-12A/B, 10 digits + decimal point, wired to the nixitest1 DIG_ nets.
+// Segment n is the digit n-1, segment 11 is the dot.
+#define TUBE_NAME "IN-12"
+#define TUBE_SEGMENTS( X ) \
+	X( PORT_C, 0 ) /*  1: DIG_0 */ \
+	X( PORT_C, 1 ) /*  2: DIG_1 */ \
+	X( PORT_C, 2 ) /*  3: DIG_2 */ \
+	X( PORT_C, 3 ) /*  4: DIG_3 */ \
+	X( PORT_C, 4 ) /*  5: DIG_4 */ \
+	X( PORT_C, 5 ) /*  6: DIG_5 */ \
+	X( PORT_C, 6 ) /*  7: DIG_6 */ \
+	X( PORT_C, 7 ) /*  8: DIG_7 */ \
+	X( PORT_D, 2 ) /*  9: DIG_8 */ \
+	X( PORT_D, 3 ) /* 10: DIG_9 */ \
+	X( PORT_D, 0 ) /* 11: DIG_DOT */
+
+#else
+
+// IN-15A/B on the nixitest1 board.  This is how the original if/else chain
+// in GenOnMask was wired.  Segment 12 lands on PD7, which is the AUX neon,
+// and is owned by TIM2 CH4, so asking for it lights nothing.
+#define TUBE_IN15
+#define TUBE_NAME "IN-15"
+#define TUBE_SEGMENTS( X ) \
+	X( PORT_C, 0 ) /*  1: DIG_0 */ \
+	X( PORT_C, 1 ) /*  2: DIG_1 */ \
+	X( PORT_C, 2 ) /*  3: DIG_2 */ \
+	X( PORT_C, 3 ) /*  4: DIG_3 */ \
+	X( PORT_C, 4 ) /*  5: DIG_4 */ \
+	X( PORT_C, 5 ) /*  6: DIG_5 */ \
+	X( PORT_C, 6 ) /*  7: DIG_6 */ \
+	X( PORT_C, 7 ) /*  8: DIG_7 */ \
+	X( PORT_D, 2 ) /*  9: DIG_8 */ \
+	X( PORT_D, 3 ) /* 10: DIG_9 */ \
+	X( PORT_D, 0 ) /* 11: DIG_DOT */ \
+	X( PORT_D, 7 ) /* 12: DIG_AUX */
+
+#endif
+
+// The nixitest1 board: pins on the cathode ports that are not cathodes.
+// These always win over anything a tube profile says.
+#define BOARD_GPIOD_PINS ( (1<<6) | (1<<7) | (1<<1) )
+#define BOARD_GPIOD_CFGLR ( \
+	(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*6) | /* GPIO D6 Debug */ \
+	(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP_AF)<<(4*7) | /* DIG_AUX (TIM2CH4) */ \
+	(GPIO_Speed_10MHz | GPIO_CNF_IN_FLOATING)<<(4*1) ) /* PGM Floats. */
+#define BOARD_GPIOD_OUTDR 0x80
+#define BOARD_GPIOC_PINS 0
+#define BOARD_GPIOC_CFGLR 0
+
+// Everything below is generated from the lists above.
+
+// Masks are GPIOC bits in the low byte and GPIOD bits in the high byte,
+// the same as what ApplyOnMask takes.
+#define TUBE_PIN_MASK( port, pin ) \
+	( ( (port) == PORT_D ) ? ( (1<<(pin)) << 8 ) : (1<<(pin)) )
+#define TUBE_TABLE_ENTRY( port, pin ) TUBE_PIN_MASK( port, pin ),
+#define TUBE_OR_ENTRY( port, pin ) | TUBE_PIN_MASK( port, pin )
+#define TUBE_COUNT_ENTRY( port, pin ) + 1
+
+#define NUM_SEGMENTS ( 0 TUBE_SEGMENTS( TUBE_COUNT_ENTRY ) )
+#define TUBE_CATHODE_MASK ( 0 TUBE_SEGMENTS( TUBE_OR_ENTRY ) )
+#define TUBE_CATHODES_C ( TUBE_CATHODE_MASK & 0xff & ~BOARD_GPIOC_PINS )
+#define TUBE_CATHODES_D ( ( TUBE_CATHODE_MASK >> 8 ) & ~BOARD_GPIOD_PINS )
+
+static const uint16_t tube_segment_masks[NUM_SEGMENTS+1] =
+	{ 0, TUBE_SEGMENTS( TUBE_TABLE_ENTRY ) };
+
+// Push-pull outputs for every pin set in bits, all others are left at 0,
+// which is analog input.
+#define CATHODE_PIN_CFG( bits, pin ) \
+	( ( ( (bits) >> (pin) ) & 1 ) ? \
+		(GPIO_Speed_10MHz | GPIO_CNF_OUT_PP)<<(4*(pin)) : 0 )
+#define CATHODE_CFGLR( bits ) ( \
+	CATHODE_PIN_CFG( bits, 0 ) | CATHODE_PIN_CFG( bits, 1 ) | \
+	CATHODE_PIN_CFG( bits, 2 ) | CATHODE_PIN_CFG( bits, 3 ) | \
+	CATHODE_PIN_CFG( bits, 4 ) | CATHODE_PIN_CFG( bits, 5 ) | \
+	CATHODE_PIN_CFG( bits, 6 ) | CATHODE_PIN_CFG( bits, 7 ) )
+
+#define TUBE_GPIOC_CFGLR ( CATHODE_CFGLR( TUBE_CATHODES_C ) | BOARD_GPIOC_CFGLR )
+#define TUBE_GPIOD_CFGLR ( CATHODE_CFGLR( TUBE_CATHODES_D ) | BOARD_GPIOD_CFGLR )
+
+#endif
+